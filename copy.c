@@ -0,0 +1,77 @@
+// 6502 routine copying image planes to card memory.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "copy.h"
+
+// Copies one plane from its packed layout to card memory. Patched with the
+// number of rows and bytes per row:
+//
+//          LDX #ROWS
+//  ROW:    LDY #ROW_BYTES-1
+//  BYTE:   LDA (SRC),Y
+//          STA (DST),Y
+//          DEY
+//          BPL BYTE
+//          CLC
+//          LDA SRC
+//          ADC #ROW_BYTES
+//          STA SRC
+//          BCC :+
+//          INC SRC+1
+//  :       CLC
+//          LDA DST
+//          ADC #40
+//          STA DST
+//          BCC :+
+//          INC DST+1
+//  :       DEX
+//          BNE ROW
+//          RTS
+//
+static const uint8_t copy_routine[] = {
+    0xA2, 0x00, 0xA0, 0x00, 0xB1, COPY_ROUTINE_SRC, 0x91, COPY_ROUTINE_DST, 0x88, 0x10, 0xF9,
+    0x18, 0xA5, COPY_ROUTINE_SRC, 0x69, 0x00, 0x85, COPY_ROUTINE_SRC, 0x90, 0x02, 0xE6, COPY_ROUTINE_SRC + 1,
+    0x18, 0xA5, COPY_ROUTINE_DST, 0x69, COPY_CARD_ROW_BYTES, 0x85, COPY_ROUTINE_DST, 0x90, 0x02, 0xE6, COPY_ROUTINE_DST + 1,
+    0xCA, 0xD0, 0xDE, 0x60
+};
+#define COPY_ROUTINE_ROWS 1
+#define COPY_ROUTINE_LAST_BYTE 3
+#define COPY_ROUTINE_ROW_BYTES 15
+
+// The plane is loaded below the card if it fits after the routine, or else
+// right above it
+uint32_t copy_source( uint32_t card, uint32_t plane_size )
+{
+    return card >= COPY_ROUTINE_END + plane_size ? COPY_ROUTINE_END : card + COPY_CARD_SIZE;
+}
+
+// Clears the memory, loads the routine and the plane at source and runs it to
+// copy the plane to the card. Returns false if it does not return.
+bool copy_plane( m6502_t *cpu, uint8_t *memory, const uint8_t *plane, uint32_t source, uint32_t card, uint16_t row_bytes, uint16_t rows )
+{
+    memset( memory, 0, M6502_MEMORY_SIZE );
+    memcpy( memory + COPY_ROUTINE_ADDRESS, copy_routine, sizeof( copy_routine ) );
+    memory[COPY_ROUTINE_ADDRESS + COPY_ROUTINE_ROWS] = rows;
+    memory[COPY_ROUTINE_ADDRESS + COPY_ROUTINE_LAST_BYTE] = row_bytes - 1;
+    memory[COPY_ROUTINE_ADDRESS + COPY_ROUTINE_ROW_BYTES] = row_bytes;
+    memory[COPY_ROUTINE_SRC] = source & 0xFF;
+    memory[COPY_ROUTINE_SRC + 1] = source >> 8;
+    memory[COPY_ROUTINE_DST] = card & 0xFF;
+    memory[COPY_ROUTINE_DST + 1] = card >> 8;
+    memcpy( memory + source, plane, (size_t) row_bytes * rows );
+
+    m6502_reset( cpu, memory );
+
+    return m6502_call( cpu, COPY_ROUTINE_ADDRESS, 100 * COPY_CARD_SIZE );
+}
@@ -0,0 +1,29 @@
+// 6502 routine copying image planes to card memory.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+#ifndef COPY_H
+#define COPY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "m6502.h"
+
+#define COPY_ROUTINE_ADDRESS 0x0200
+#define COPY_ROUTINE_SRC 0xF0
+#define COPY_ROUTINE_DST 0xF2
+#define COPY_ROUTINE_END 0x0300
+#define COPY_CARD_ROW_BYTES 40
+#define COPY_CARD_SIZE 8192
+
+uint32_t copy_source( uint32_t card, uint32_t plane_size );
+bool copy_plane( m6502_t *cpu, uint8_t *memory, const uint8_t *plane, uint32_t source, uint32_t card, uint16_t row_bytes, uint16_t rows );
+
+#endif
@@ -0,0 +1,152 @@
+// Ordered dithering of continuous tone images.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// A Bayer matrix is used so the dither pattern for a given source level is
+// fixed to the screen position and does not change between frames. For
+// animations, pixels whose source changed less than the threshold since the
+// last decision keep the previous output, so that noise does not show up in
+// the frame deltas.
+//
+// The dither strength scales the matrix around its midpoint, down to plain
+// quantization at 0%. Snapping sets pixels close to the background level,
+// that of palette color 0, to it, which produces more zero bytes for sparse
+// transfers.
+//
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "dither.h"
+
+static const uint8_t bayer[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+// ITU-R BT.601 luma
+uint8_t dither_luma( uint8_t r, uint8_t g, uint8_t b )
+{
+    return ( 299 * r + 587 * g + 114 * b + 500 ) / 1000;
+}
+
+void dither_levels( dither_levels_t *levels, const uint8_t *palette_luma, int ncolors )
+{
+    levels->nlevels = 0;
+
+    // Insertion sort, dropping colors with duplicated luma
+    for ( int c = 0; c < ncolors && c < DITHER_MAX_LEVELS; ++c )
+    {
+        int l;
+
+        for ( l = 0; l < levels->nlevels && levels->luma[l] < palette_luma[c]; ++l );
+
+        if ( l < levels->nlevels && levels->luma[l] == palette_luma[c] )
+        {
+            continue;
+        }
+
+        for ( int m = levels->nlevels; m > l; --m )
+        {
+            levels->luma[m] = levels->luma[m - 1];
+            levels->index[m] = levels->index[m - 1];
+        }
+
+        levels->luma[l] = palette_luma[c];
+        levels->index[l] = c;
+        ++levels->nlevels;
+    }
+}
+
+static uint8_t dither_pixel( const dither_levels_t *levels, uint8_t luma, uint16_t x, uint16_t y, int strength )
+{
+    int hi;
+
+    for ( hi = 0; hi < levels->nlevels && levels->luma[hi] <= luma; ++hi );
+
+    if ( 0 == hi )
+    {
+        return levels->index[0];
+    }
+    if ( levels->nlevels == hi )
+    {
+        return levels->index[hi - 1];
+    }
+
+    int lo = hi - 1;
+
+    // ( luma - lo ) / ( hi - lo ) > 0.5 + strength * ( ( bayer + 0.5 ) / 64 - 0.5 )
+    if ( ( luma - levels->luma[lo] ) * 128 * 100 > ( 6400 + strength * ( 2 * bayer[y & 7][x & 7] + 1 - 64 ) ) * ( levels->luma[hi] - levels->luma[lo] ) )
+    {
+        return levels->index[hi];
+    }
+
+    return levels->index[lo];
+}
+
+// Returns the number of pixels that kept the previous frame's output
+int dither_image( const dither_levels_t *levels, const uint8_t *luma, uint8_t *image, uint16_t x_size, uint16_t y_size, dither_history_t *history, const dither_params_t *params )
+{
+    bool temporal = NULL != history && history->valid && params->threshold > 0
+                    && history->x_size == x_size && history->y_size == y_size;
+    int kept = 0;
+    int background;
+
+    for ( background = 0; background < levels->nlevels - 1 && levels->index[background]; ++background );
+
+    for ( uint16_t y = 0; y < y_size; ++y )
+    {
+        for ( uint16_t x = 0; x < x_size; ++x )
+        {
+            int pixel = y * x_size + x;
+
+            if ( temporal && abs( luma[pixel] - history->luma[pixel] ) < params->threshold )
+            {
+                image[pixel] = history->image[pixel];
+                ++kept;
+                continue;
+            }
+
+            if ( abs( luma[pixel] - levels->luma[background] ) < params->snap )
+            {
+                image[pixel] = levels->index[background];
+            }
+            else
+            {
+                image[pixel] = dither_pixel( levels, luma[pixel], x, y, params->strength );
+            }
+
+            // Remember the source the decision was made at, so slow drifts
+            // are eventually picked up
+            if ( NULL != history )
+            {
+                history->luma[pixel] = luma[pixel];
+            }
+        }
+    }
+
+    if ( NULL != history )
+    {
+        for ( int pixel = 0; pixel < x_size * y_size; ++pixel )
+        {
+            history->image[pixel] = image[pixel];
+        }
+        history->x_size = x_size;
+        history->y_size = y_size;
+        history->valid = true;
+    }
+
+    return kept;
+}
@@ -0,0 +1,46 @@
+// Ordered dithering of continuous tone images.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DITHER_MAX_LEVELS 16
+
+// Palette gray levels sorted by luma
+typedef struct {
+    int nlevels;
+    uint8_t luma[DITHER_MAX_LEVELS];
+    uint8_t index[DITHER_MAX_LEVELS];
+} dither_levels_t;
+
+// Previous frame state for temporally coherent dithering. The buffers must be
+// able to hold a full image.
+typedef struct {
+    bool valid;
+    uint16_t x_size;
+    uint16_t y_size;
+    uint8_t *luma;
+    uint8_t *image;
+} dither_history_t;
+
+typedef struct {
+    int strength;       // Percentage of the dither matrix amplitude
+    int snap;           // Pixels this close to the background level are set to it
+    int threshold;      // Temporal coherence threshold, 0 disables it
+} dither_params_t;
+
+uint8_t dither_luma( uint8_t r, uint8_t g, uint8_t b );
+void dither_levels( dither_levels_t *levels, const uint8_t *palette_luma, int ncolors );
+int dither_image( const dither_levels_t *levels, const uint8_t *luma, uint8_t *image, uint16_t x_size, uint16_t y_size, dither_history_t *history, const dither_params_t *params );
+
+#endif
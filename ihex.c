@@ -12,6 +12,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "hex.h"
+
 #ifndef UNUSED
 #define UNUSED(x) (void)(x)
 #endif
@@ -33,7 +35,7 @@ bool ihex_terminate( FILE *output_file, uint16_t lines )
 
 uint16_t ihex_write( FILE *output_file, uint16_t address, uint8_t *data, size_t data_size )
 {
-    int byte_num = 0;
+    size_t byte_num = 0;
     uint8_t checksum = 0;
     uint16_t lines = 0;
 
@@ -79,3 +81,48 @@ uint16_t ihex_write( FILE *output_file, uint16_t address, uint8_t *data, size_t
 
     return lines;
 }
+
+// Same output as ihex_write(), but every record is formatted in a buffer with
+// a digit table and written at once
+uint16_t ihex_write_table( FILE *output_file, uint16_t address, uint8_t *data, size_t data_size )
+{
+    char record[1 + 2 + 4 + 2 + 2 * BYTES_PER_LINE + 2 + 1];
+    size_t byte_num = 0;
+    uint16_t lines = 0;
+
+    while ( byte_num < data_size )
+    {
+        uint8_t bytes_in_line = data_size - byte_num > BYTES_PER_LINE ? BYTES_PER_LINE : data_size - byte_num;
+        uint8_t checksum = bytes_in_line + ( ( address >> 8 ) & 0xFF ) + ( address & 0xFF );
+        char *p = record;
+
+        *p++ = ':';
+        p = hex_put( p, bytes_in_line, 2 );
+        p = hex_put( p, address, 4 );
+        p = hex_put( p, 0x00, 2 );
+
+        for ( int b = 0; b < bytes_in_line; ++b )
+        {
+            uint8_t databyte = data[byte_num++];
+
+            p = hex_put( p, databyte, 2 );
+            checksum += databyte;
+        }
+
+        p = hex_put( p, (uint8_t)( ~checksum + 1 ), 2 );
+        *p++ = '\n';
+
+        size_t length = p - record;
+
+        if ( length != fwrite( record, 1, length, output_file ) )
+        {
+            perror( "Error writing to file" );
+            return 0;
+        }
+
+        address += bytes_in_line;
+        ++lines;
+    }
+
+    return lines;
+}
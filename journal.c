@@ -0,0 +1,367 @@
+// Batch conversion journal.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// Completed conversions are appended to a text journal, one line for every
+// file a job writes:
+//
+//     <input hash> <options hash> <output hash> <output size> <output file>
+//
+// The lines of a job are only appended once it has written all its files and
+// they have been synced to disk, then their directories, each once, so that the
+// journal never lists a file that a crash could lose.
+// Hashes are 64-bit FNV-1a in hex. Lines are flushed as they are written but
+// only synced to disk every JOURNAL_SYNC_BATCH jobs and on close, so a crash
+// may lose the last few entries (those jobs are just redone) and may leave a
+// partial last line, which is removed when the journal is opened again.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+
+#include "journal.h"
+
+#define JOURNAL_SYNC_BATCH 64
+#define FNV_PRIME 0x100000001B3ULL
+
+uint64_t journal_hash( const void *data, size_t size, uint64_t hash )
+{
+    const uint8_t *bytes = (const uint8_t *) data;
+
+    for ( size_t b = 0; b < size; ++b )
+    {
+        hash = ( hash ^ bytes[b] ) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+// Hashes the raw contents of a file. Returns false if it can't be read.
+bool journal_hash_file( const char *file_name, uint64_t *hash, size_t *size )
+{
+    FILE *file = fopen( file_name, "rb" );
+    char buffer[BUFSIZ];
+    size_t nbytes;
+
+    if ( NULL == file )
+    {
+        return false;
+    }
+
+    *hash = JOURNAL_HASH_INIT;
+    *size = 0;
+
+    while ( 0 != ( nbytes = fread( buffer, 1, sizeof( buffer ), file ) ) )
+    {
+        *hash = journal_hash( buffer, nbytes, *hash );
+        *size += nbytes;
+    }
+
+    bool result = !ferror( file );
+
+    fclose( file );
+
+    return result;
+}
+
+static bool add_entry( journal_entry_t **entries, int *nentries, const journal_entry_t *entry )
+{
+    journal_entry_t *new_entries = realloc( *entries, ( *nentries + 1 ) * sizeof( journal_entry_t ) );
+
+    if ( NULL == new_entries )
+    {
+        perror( "Error: Can't allocate journal entry" );
+        return false;
+    }
+
+    *entries = new_entries;
+    new_entries[*nentries] = *entry;
+
+    if ( NULL == ( new_entries[*nentries].output_filename = strdup( entry->output_filename ) ) )
+    {
+        perror( "Error: Can't allocate journal entry" );
+        return false;
+    }
+
+    ++*nentries;
+
+    return true;
+}
+
+static void free_entries( journal_entry_t **entries, int *nentries )
+{
+    for ( int e = 0; e < *nentries; ++e )
+    {
+        free( (*entries)[e].output_filename );
+    }
+    free( *entries );
+
+    *entries = NULL;
+    *nentries = 0;
+}
+
+bool journal_open( journal_t *journal, const char *file_name )
+{
+    FILE *file;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    off_t valid = 0;
+    bool partial = false;
+
+    journal->entries = NULL;
+    journal->nentries = 0;
+    journal->pending = NULL;
+    journal->npending = 0;
+    journal->unsynced = 0;
+
+    if ( NULL != ( file = fopen( file_name, "r" ) ) )
+    {
+        while ( 0 < ( length = getline( &line, &line_size, file ) ) )
+        {
+            journal_entry_t entry;
+            int name_offset = 0;
+
+            // A crash may leave a partial last line
+            if ( line[length - 1] != '\n' )
+            {
+                partial = true;
+                break;
+            }
+            line[length - 1] = '\0';
+            valid += length;
+
+            if ( 4 != sscanf( line, "%" SCNx64 " %" SCNx64 " %" SCNx64 " %zu %n", &entry.input_hash, &entry.options_hash,
+                                    &entry.output_hash, &entry.output_size, &name_offset ) || ! name_offset )
+            {
+                continue;
+            }
+
+            entry.output_filename = line + name_offset;
+
+            if ( ! add_entry( &journal->entries, &journal->nentries, &entry ) )
+            {
+                free( line );
+                fclose( file );
+                return false;
+            }
+        }
+
+        free( line );
+        fclose( file );
+
+        // Cut it, so that the next entry starts on its own line
+        if ( partial && truncate( file_name, valid ) )
+        {
+            perror( "Error truncating journal file" );
+            return false;
+        }
+
+        printf( "Journal '%s' has %d completed jobs\n", file_name, journal->nentries );
+    }
+
+    if ( NULL == ( journal->file = fopen( file_name, "a" ) ) )
+    {
+        perror( "Error opening journal file" );
+        return false;
+    }
+
+    return true;
+}
+
+// The last entry wins, as a job may have been redone
+const journal_entry_t *journal_find( const journal_t *journal, uint64_t input_hash, uint64_t options_hash, const char *output_filename )
+{
+    for ( int e = journal->nentries - 1; e >= 0; --e )
+    {
+        const journal_entry_t *entry = &journal->entries[e];
+
+        if (    entry->input_hash == input_hash && entry->options_hash == options_hash
+             && !strcmp( entry->output_filename, output_filename ) )
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static bool journal_sync( journal_t *journal )
+{
+    if ( fflush( journal->file ) || fsync( fileno( journal->file ) ) )
+    {
+        perror( "Error writing to journal file" );
+        return false;
+    }
+
+    journal->unsynced = 0;
+
+    return true;
+}
+
+// Starts a job. Files written by a previous job that failed are forgotten.
+void journal_begin( journal_t *journal, uint64_t input_hash, uint64_t options_hash )
+{
+    free_entries( &journal->pending, &journal->npending );
+
+    journal->input_hash = input_hash;
+    journal->options_hash = options_hash;
+}
+
+bool journal_add_file( journal_t *journal, const char *file_name, const void *data, size_t size )
+{
+    journal_entry_t entry = { journal->input_hash, journal->options_hash, journal_hash( data, size, JOURNAL_HASH_INIT ),
+                              size, (char *) file_name };
+
+    return add_entry( &journal->pending, &journal->npending, &entry );
+}
+
+static bool sync_path( const char *path )
+{
+    int fd = open( path, O_RDONLY );
+
+    // Some file systems can't sync directories
+    bool result = 0 <= fd && ( ! fsync( fd ) || errno == EINVAL );
+
+    if ( ! result )
+    {
+        fprintf( stderr, "Error syncing '%s': %s\n", path, strerror( errno ) );
+    }
+    if ( fd >= 0 )
+    {
+        close( fd );
+    }
+
+    return result;
+}
+
+// Syncs the files written by the current job and then their directories, so
+// that the renames into them are durable too
+static bool sync_pending( journal_t *journal )
+{
+    char **dirs = calloc( journal->npending, sizeof( char * ) );
+    int ndirs = 0;
+    bool result = NULL != dirs;
+
+    if ( ! result )
+    {
+        perror( "Error: Can't allocate journal directories" );
+    }
+
+    for ( int e = 0; result && e < journal->npending; ++e )
+    {
+        result = sync_path( journal->pending[e].output_filename );
+    }
+
+    for ( int e = 0; result && e < journal->npending; ++e )
+    {
+        char *name = strdup( journal->pending[e].output_filename );
+        char *dir;
+        int d;
+
+        if ( NULL == name )
+        {
+            perror( "Error: Can't allocate journal directories" );
+            result = false;
+            break;
+        }
+
+        dir = dirname( name );
+
+        for ( d = 0; d < ndirs; ++d )
+        {
+            if ( ! strcmp( dirs[d], dir ) )
+            {
+                break;
+            }
+        }
+
+        if ( d == ndirs )
+        {
+            if ( NULL == ( dirs[ndirs] = strdup( dir ) ) )
+            {
+                perror( "Error: Can't allocate journal directories" );
+                result = false;
+            }
+            else
+            {
+                result = sync_path( dirs[ndirs++] );
+            }
+        }
+
+        free( name );
+    }
+
+    for ( int d = 0; d < ndirs; ++d )
+    {
+        free( dirs[d] );
+    }
+    free( dirs );
+
+    return result;
+}
+
+// Appends the files written by the current job, once they are on disk
+bool journal_commit( journal_t *journal )
+{
+    if ( ! sync_pending( journal ) )
+    {
+        return false;
+    }
+
+    for ( int e = 0; e < journal->npending; ++e )
+    {
+        const journal_entry_t *entry = &journal->pending[e];
+
+        if ( 0 > fprintf( journal->file, "%016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %zu %s\n", entry->input_hash,
+                            entry->options_hash, entry->output_hash, entry->output_size, entry->output_filename ) )
+        {
+            perror( "Error writing to journal file" );
+            return false;
+        }
+    }
+
+    free_entries( &journal->pending, &journal->npending );
+
+    if ( ++journal->unsynced == JOURNAL_SYNC_BATCH )
+    {
+        return journal_sync( journal );
+    }
+
+    if ( fflush( journal->file ) )
+    {
+        perror( "Error writing to journal file" );
+        return false;
+    }
+
+    return true;
+}
+
+bool journal_close( journal_t *journal )
+{
+    bool result = journal_sync( journal );
+
+    if ( EOF == fclose( journal->file ) )
+    {
+        perror( "Error writing to journal file" );
+        result = false;
+    }
+
+    free_entries( &journal->entries, &journal->nentries );
+    free_entries( &journal->pending, &journal->npending );
+
+    return result;
+}
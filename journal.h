@@ -0,0 +1,49 @@
+// Batch conversion journal.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define JOURNAL_HASH_INIT 0xCBF29CE484222325ULL
+
+typedef struct {
+    uint64_t input_hash;
+    uint64_t options_hash;
+    uint64_t output_hash;
+    size_t output_size;
+    char *output_filename;
+} journal_entry_t;
+
+typedef struct {
+    FILE *file;
+    journal_entry_t *entries;
+    int nentries;
+    journal_entry_t *pending;           // Files written by the current job
+    int npending;
+    uint64_t input_hash;
+    uint64_t options_hash;
+    int unsynced;
+} journal_t;
+
+uint64_t journal_hash( const void *data, size_t size, uint64_t hash );
+bool journal_hash_file( const char *file_name, uint64_t *hash, size_t *size );
+bool journal_open( journal_t *journal, const char *file_name );
+const journal_entry_t *journal_find( const journal_t *journal, uint64_t input_hash, uint64_t options_hash, const char *output_filename );
+void journal_begin( journal_t *journal, uint64_t input_hash, uint64_t options_hash );
+bool journal_add_file( journal_t *journal, const char *file_name, const void *data, size_t size );
+bool journal_commit( journal_t *journal );
+bool journal_close( journal_t *journal );
+
+#endif
@@ -0,0 +1,218 @@
+// Kernel variant selection.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// The hot stages (tokenizing, plane packing and hex encoding) have several
+// implementations and the fastest one depends on the CPU and the image shape.
+// "kimg --tune" times them and stores the winners in a profile file, one line
+// per stage, width class and color depth:
+//
+//     <stage> <width> <color bits> <variant> <CPU model>
+//
+// Only the lines for the CPU kimg runs on are used, so a profile can be shared
+// by several machines. Without a profile, the first variant of every stage,
+// which is the original implementation, is used.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernels.h"
+
+#define PROFILE_NAME ".kimg_profile"
+
+const char *kernel_stage_names[KERNEL_STAGES] = { "parse", "pack", "hex" };
+
+const char *kernel_variant_names[KERNEL_STAGES][KERNEL_VARIANTS] = {
+    { "strtoul", "digits" },
+    { "bitwise", "transpose" },
+    { "printf", "table" }
+};
+
+// 101 is not a multiple of 8, so the partial last byte of every row is checked
+const uint16_t kernel_widths[KERNEL_WIDTHS] = { 64, 101, 160, 320 };
+
+static kernel_profile_t selected;
+
+const char *kernel_cpu_model( void )
+{
+    static char model[256] = "";
+    char line[512];
+    FILE *cpuinfo;
+
+    if ( *model )
+    {
+        return model;
+    }
+
+    strcpy( model, "unknown" );
+
+    if ( NULL != ( cpuinfo = fopen( "/proc/cpuinfo", "r" ) ) )
+    {
+        while ( NULL != fgets( line, sizeof( line ), cpuinfo ) )
+        {
+            char *colon = strchr( line, ':' );
+
+            if ( !strncmp( line, "model name", 10 ) && NULL != colon )
+            {
+                snprintf( model, sizeof( model ), "%s", colon + 1 + strspn( colon + 1, " \t" ) );
+                model[strcspn( model, "\n" )] = '\0';
+                break;
+            }
+        }
+        fclose( cpuinfo );
+    }
+
+    return model;
+}
+
+// $KIMG_PROFILE or ~/.kimg_profile
+const char *kernel_profile_filename( void )
+{
+    static char *file_name = NULL;
+    const char *home;
+
+    if ( NULL != file_name )
+    {
+        return file_name;
+    }
+
+    if ( NULL != ( file_name = getenv( "KIMG_PROFILE" ) ) )
+    {
+        return file_name;
+    }
+
+    if ( NULL == ( home = getenv( "HOME" ) ) )
+    {
+        home = ".";
+    }
+
+    if ( 0 > asprintf( &file_name, "%s/%s", home, PROFILE_NAME ) )
+    {
+        file_name = NULL;
+        return PROFILE_NAME;
+    }
+
+    return file_name;
+}
+
+static int find_name( const char **names, int nnames, const char *name )
+{
+    for ( int n = 0; n < nnames; ++n )
+    {
+        if ( !strcmp( names[n], name ) )
+        {
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+static int width_class( uint16_t x_size )
+{
+    int w;
+
+    for ( w = 0; w < KERNEL_WIDTHS - 1 && x_size > kernel_widths[w]; ++w );
+
+    return w;
+}
+
+// Loads the winners for this CPU. Returns false if there are none.
+bool kernel_load_profile( void )
+{
+    FILE *file = fopen( kernel_profile_filename(), "r" );
+    const char *model = kernel_cpu_model();
+    char line[512], stage_name[16], variant_name[16];
+    bool found = false;
+
+    if ( NULL == file )
+    {
+        return false;
+    }
+
+    while ( NULL != fgets( line, sizeof( line ), file ) )
+    {
+        unsigned width, color_bits;
+        int offset = 0, stage, variant;
+
+        line[strcspn( line, "\n" )] = '\0';
+
+        if (    4 != sscanf( line, "%15s %u %u %15s %n", stage_name, &width, &color_bits, variant_name, &offset )
+             || ! offset || strcmp( line + offset, model ) )
+        {
+            continue;
+        }
+
+        stage = find_name( kernel_stage_names, KERNEL_STAGES, stage_name );
+        variant = stage < 0 ? -1 : find_name( kernel_variant_names[stage], KERNEL_VARIANTS, variant_name );
+
+        if ( variant < 0 || color_bits < 1 || color_bits > KERNEL_MAX_BITS || width > UINT16_MAX )
+        {
+            fprintf( stderr, "Warning: Ignoring bad profile line: %s\n", line );
+            continue;
+        }
+
+        selected[stage][width_class( width )][color_bits - 1] = variant;
+        found = true;
+    }
+
+    fclose( file );
+
+    return found;
+}
+
+// Writes the lines of a profile for this CPU
+bool kernel_write_profile( FILE *file, const kernel_profile_t profile )
+{
+    for ( int stage = 0; stage < KERNEL_STAGES; ++stage )
+    {
+        for ( int w = 0; w < KERNEL_WIDTHS; ++w )
+        {
+            for ( int bits = 1; bits <= KERNEL_MAX_BITS; ++bits )
+            {
+                if ( 0 > fprintf( file, "%s %u %d %s %s\n", kernel_stage_names[stage], kernel_widths[w], bits,
+                                  kernel_variant_names[stage][profile[stage][w][bits - 1]], kernel_cpu_model() ) )
+                {
+                    perror( "Error writing profile" );
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+int kernel_select( kernel_stage_t stage, uint16_t x_size, int color_bits )
+{
+    if ( color_bits < 1 )
+    {
+        color_bits = 1;
+    }
+    else if ( color_bits > KERNEL_MAX_BITS )
+    {
+        color_bits = KERNEL_MAX_BITS;
+    }
+
+    return selected[stage][width_class( x_size )][color_bits - 1];
+}
+
+double kernel_time( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,38 @@
+// Kernel variant selection.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum { KERNEL_PARSE, KERNEL_PACK, KERNEL_HEX, KERNEL_STAGES } kernel_stage_t;
+
+#define KERNEL_VARIANTS 2
+#define KERNEL_WIDTHS 4
+#define KERNEL_MAX_BITS 4
+
+extern const char *kernel_stage_names[KERNEL_STAGES];
+extern const char *kernel_variant_names[KERNEL_STAGES][KERNEL_VARIANTS];
+extern const uint16_t kernel_widths[KERNEL_WIDTHS];
+
+// Winner of every stage for every width class and color depth
+typedef int kernel_profile_t[KERNEL_STAGES][KERNEL_WIDTHS][KERNEL_MAX_BITS];
+
+const char *kernel_cpu_model( void );
+const char *kernel_profile_filename( void );
+bool kernel_load_profile( void );
+bool kernel_write_profile( FILE *file, const kernel_profile_t profile );
+int kernel_select( kernel_stage_t stage, uint16_t x_size, int color_bits );
+double kernel_time( void );
+
+#endif
@@ -12,13 +12,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
 #include <libgen.h>
 #include <math.h>
 #include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 
 #include "ihex.h"
 #include "pap.h"
+#include "o65.h"
+#include "zfile.h"
+#include "xcf.h"
+#include "parallel.h"
+#include "dither.h"
+#include "m6502.h"
+#include "copy.h"
+#include "send.h"
+#include "slideshow.h"
+#include "journal.h"
+#include "pack.h"
+#include "kernels.h"
 
 #define MAX_PALETTE_SIZE 16
 #define MAX_COL_BYTES 40
@@ -29,6 +45,7 @@
 #define MIN_BASE_ADDRESS 0x2000
 #define MAX_BASE_ADDRESS 0xA000
 #define DEFAULT_BASE_ADDRESS MIN_BASE_ADDRESS
+#define DEFAULT_BAUD_RATE 2400
 
 typedef bool (*output_fn_t)();
 
@@ -36,37 +53,74 @@ typedef struct {
     char *format_string;
     char *format_des;
     output_fn_t output_fn;
+    bool records;               // Line records that can be sent to a serial port
 } formats_t; 
 
 typedef struct {
     uint16_t base_address;
-    char *input_filename;
+    char **input_filenames;
+    int ninputs;
     char *output_filename;
     char *palette_filename;
+    char *dep_filename;
+    int temporal_threshold;
+    bool simulate;
+    bool sparse;
+    size_t budget;
+    unsigned baud_rate;
+    char **port_names;
+    int nports;
+    unsigned char_delay;
+    bool verify_echo;
+    char *order_filename;
+    uint8_t *reference;         // Previous image for delta output
+    char *journal_filename;
+    journal_t *journal;
+    uint64_t options_hash;      // Everything but the input that affects the output
+    char **payload_filenames;
+    int npayloads;
+    pack_payload_t *payloads;
+    bool tune;
+    bool stats;
+    int kernels[KERNEL_STAGES]; // Variants selected for the current image
     const formats_t *format;
 } options_t;
 
+typedef struct {
+    char *input_filename;
+    char *output_filename;
+    uint8_t *image;
+    int data_size;
+    int color_bits;
+    uint16_t x_size;
+    uint16_t y_size;
+} slide_t;
+
 typedef struct {
     uint8_t r;
     uint8_t g;
     uint8_t b;
 } color_t;
 
-bool output_binary( uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size );
-bool output_pap( uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size );
-bool output_ihex( uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size );
-bool output_asm( uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size );
+bool output_binary( FILE *output_file, uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size );
+bool output_pap( FILE *output_file, uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size );
+bool output_ihex( FILE *output_file, uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size );
+bool output_asm( FILE *output_file, uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size );
+bool output_o65( FILE *output_file, uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size );
 
 static const formats_t formats[] = {
-    { "pap", "MOS Papertape (default)", (output_fn_t) output_pap },
-    { "ihex", "Intel HEX", (output_fn_t) output_ihex },
-    { "asm", "CA65 assembly code", (output_fn_t) output_asm },
+    { "pap", "MOS Papertape (default)", (output_fn_t) output_pap, true },
+    { "ihex", "Intel HEX", (output_fn_t) output_ihex, true },
+    { "asm", "CA65 assembly code", (output_fn_t) output_asm, false },
+    { "o65", "o65 relocatable object", (output_fn_t) output_o65, false },
 #if 0
-    { "bin", "Binary output", (output_fn_t) output_binary },
+    { "bin", "Binary output", (output_fn_t) output_binary, false },
 #endif
     { NULL }
 };
 
+static const char *card_name[] = { "MASTER", "SLAVE_1", "SLAVE_2", "SLAVE_3" };
+
 FILE *open_palette( char *file_name, char *buffer )
 {
     static const char palette_sig[] = "GIMP Palette\n";
@@ -140,18 +194,25 @@ int read_palette( char *file_name, char *buffer, size_t bufsiz, color_t *palette
     return ncolors;
 }
 
-bool get_image_dimensions( FILE *image_file, char *buffer, size_t bufsiz, uint16_t *x_size, uint16_t *y_size )
+bool get_image_dimensions( FILE *image_file, char *buffer, size_t bufsiz, uint16_t *x_size, uint16_t *y_size, bool *rgb )
 {
     static const char x_size_s[] = "static unsigned int width = %hu;";
     static const char y_size_s[] = "static unsigned int height = %hu;";
+    static const char rgb_s[] = "GIMP header image file format (RGB)";
 
     char *line;
 
     *x_size = 0;
     *y_size = 0;
+    *rgb = false;
 
     while ( NULL != ( line = fgets( buffer, bufsiz, image_file ) ) )
     {
+        if ( strstr( line, rgb_s ) )
+        {
+            *rgb = true;
+        }
+
         sscanf( line, x_size_s, x_size );
         sscanf( line, y_size_s, y_size );
 
@@ -164,6 +225,22 @@ bool get_image_dimensions( FILE *image_file, char *buffer, size_t bufsiz, uint16
     return false;
 }
 
+// Returns the palette index of the color or ncolors if not found
+int find_color( color_t *palette, int ncolors, uint8_t r, uint8_t g, uint8_t b )
+{
+    int c;
+
+    for ( c = 0; c < ncolors; ++c )
+    {
+        if ( palette[c].r == r && palette[c].g == g && palette[c].b == b )
+        {
+            break;
+        }
+    }
+
+    return c;
+}
+
 int translate_cmap( FILE *image_file, char *buffer, size_t bufsiz, color_t *palette, uint8_t *cmap, int ncolors )
 {
     char *line;
@@ -189,13 +266,7 @@ int translate_cmap( FILE *image_file, char *buffer, size_t bufsiz, color_t *pale
             {
                 ++start;
 
-                for ( c = 0; c < ncolors; ++c )
-                {
-                    if ( palette[c].r == r && palette[c].g == g && palette[c].b == b )
-                    {
-                        break;
-                    }
-                }
+                c = find_color( palette, ncolors, r, g, b );
 
                 if ( c == ncolors )
                 {
@@ -225,14 +296,15 @@ int translate_cmap( FILE *image_file, char *buffer, size_t bufsiz, color_t *pale
     return image_colors;
 }
 
-bool search_for_header_data( FILE *image_file, char *buffer, size_t bufsiz )
+bool search_for_header_data( FILE *image_file, char *buffer, size_t bufsiz, bool rgb )
 {
     static const char header_s[] = "static unsigned char header_data[] = {\n";
+    static const char rgb_header_s[] = "static char *header_data =\n";
     char *line;
 
     while ( NULL != ( line = fgets( buffer, bufsiz, image_file ) ) )
     {
-        if ( !strncmp( line, header_s, sizeof( header_s ) ) )
+        if ( !strcmp( line, rgb ? rgb_header_s : header_s ) )
         {
             return true;
         }
@@ -241,63 +313,353 @@ bool search_for_header_data( FILE *image_file, char *buffer, size_t bufsiz )
     return false;
 }
 
-int parse_image( FILE *image_file, char *buffer, size_t bufsiz, uint8_t *image, uint8_t *cmap )
+#define MIN_CHUNK_SIZE 65536
+
+typedef struct {
+    char *start;
+    char *end;
+    uint8_t *pixels;
+    int npixels;
+    int errnum;
+} parse_chunk_t;
+
+typedef struct {
+    parse_chunk_t *chunks;
+    uint8_t *cmap;
+} parse_ctx_t;
+
+// Tokenizes a chunk of complete lines of the header_data array
+static void parse_chunk( void *arg, int job )
+{
+    parse_ctx_t *ctx = arg;
+    parse_chunk_t *chunk = &ctx->chunks[job];
+    char *line = chunk->start;
+
+    while ( line < chunk->end )
+    {
+        if ( !isdigit( *line ) )
+        {
+            ++line;
+            continue;
+        }
+
+        errno = 0;
+        uint8_t color = (uint8_t)strtoul( line, &line, 10 );
+
+        if ( errno )
+        {
+            chunk->errnum = errno;
+            return;
+        }
+
+        chunk->pixels[chunk->npixels++] = ctx->cmap[color];
+    }
+}
+
+// Same as parse_chunk(), with the numbers converted inline
+static void parse_chunk_digits( void *arg, int job )
+{
+    parse_ctx_t *ctx = arg;
+    parse_chunk_t *chunk = &ctx->chunks[job];
+    const char *line = chunk->start;
+
+    while ( line < chunk->end )
+    {
+        unsigned long value = 0;
+
+        if ( *line < '0' || *line > '9' )
+        {
+            ++line;
+            continue;
+        }
+
+        for ( ; *line >= '0' && *line <= '9'; ++line )
+        {
+            unsigned digit = *line - '0';
+
+            if ( value > ( ULONG_MAX - digit ) / 10 )
+            {
+                chunk->errnum = ERANGE;
+                return;
+            }
+            value = value * 10 + digit;
+        }
+
+        chunk->pixels[chunk->npixels++] = ctx->cmap[(uint8_t) value];
+    }
+}
+
+static const parallel_job_fn parse_kernels[KERNEL_VARIANTS] = { parse_chunk, parse_chunk_digits };
+
+// Reads the rest of the header_data array into memory, splits it at newline
+// boundaries and tokenizes the chunks in parallel. Every number takes at least
+// two characters with its separator, which bounds each chunk's pixel count.
+int parse_image( FILE *image_file, uint8_t *image, uint8_t *cmap, int kernel )
 {
+    size_t text_size = 0, allocated = 0, nbytes;
+    char *text = NULL;
     int image_size = 0;
+
+    do
+    {
+        if ( text_size + 1 >= allocated )
+        {
+            allocated = allocated ? allocated * 2 : BUFSIZ * 64;
+            char *new_text = realloc( text, allocated );
+
+            if ( NULL == new_text )
+            {
+                perror( "Error: Can't allocate image data buffer" );
+                free( text );
+                return 0;
+            }
+            text = new_text;
+        }
+
+        nbytes = fread( text + text_size, 1, allocated - text_size - 1, image_file );
+        text_size += nbytes;
+
+    } while ( nbytes );
+
+    text[text_size] = '\0';
+
+    // The data ends at the line containing "};"
+    char *data_end = strstr( text, "};" );
+    bool found_end = ( NULL != data_end );
+
+    if ( found_end )
+    {
+        while ( data_end > text && data_end[-1] != '\n' )
+        {
+            --data_end;
+        }
+    }
+    else
+    {
+        data_end = text + text_size;
+    }
+
+    size_t data_size = data_end - text;
+    int nchunks = data_size / MIN_CHUNK_SIZE;
+
+    if ( nchunks > parallel_threads() * 4 )
+    {
+        nchunks = parallel_threads() * 4;
+    }
+    if ( nchunks < 1 )
+    {
+        nchunks = 1;
+    }
+
+    parse_chunk_t *chunks = calloc( nchunks, sizeof( parse_chunk_t ) );
+    uint8_t *pixels = malloc( data_size / 2 + nchunks );
+
+    if ( NULL == chunks || NULL == pixels )
+    {
+        perror( "Error: Can't allocate image data buffer" );
+        goto out;
+    }
+
+    char *chunk_start = text;
+
+    for ( int c = 0; c < nchunks; ++c )
+    {
+        char *chunk_end = text + data_size * ( c + 1 ) / nchunks;
+
+        while ( chunk_end < data_end && chunk_end[-1] != '\n' )
+        {
+            ++chunk_end;
+        }
+
+        chunks[c].start = chunk_start;
+        chunks[c].end = chunk_end;
+        chunks[c].pixels = pixels + ( chunk_start - text ) / 2 + c;
+        chunk_start = chunk_end;
+    }
+
+    parse_ctx_t ctx = { chunks, cmap };
+
+    parallel_run( nchunks, parse_kernels[kernel], &ctx );
+
+    // Stitch the chunks in order, reporting the first error found
+    for ( int c = 0; c < nchunks; ++c )
+    {
+        if ( image_size + chunks[c].npixels > MAX_IMAGE_SIZE )
+        {
+            fputs( "Error: Image is too big.\n", stderr );
+            image_size = 0;
+            goto out;
+        }
+
+        memcpy( image + image_size, chunks[c].pixels, chunks[c].npixels );
+        image_size += chunks[c].npixels;
+
+        if ( chunks[c].errnum )
+        {
+            errno = chunks[c].errnum;
+            perror( "Error: Bad image data format" );
+            image_size = 0;
+            goto out;
+        }
+    }
+
+    if ( ! found_end )
+    {
+        fputs( "Error: Can't find image data end\n", stderr );
+        image_size = 0;
+    }
+
+out:
+    free( pixels );
+    free( chunks );
+    free( text );
+
+    return image_size;
+}
+
+// Decodes the header_data string of an RGB header, four characters per pixel,
+// into luma values for dithering
+int parse_rgb_image( FILE *image_file, char *buffer, size_t bufsiz, uint8_t *luma )
+{
+    int image_size = 0, nchars = 0;
+    uint8_t chars[4];
     char *line;
 
     while ( NULL != ( line = fgets( buffer, bufsiz, image_file ) ) )
     {
-        if ( strstr( line, "};" ) )
+        if ( NULL == ( line = strchr( line, '"' ) ) )
         {
-            return image_size;
+            fputs( "Error: Bad image data format\n", stderr );
+            return 0;
         }
 
-        while ( *line != '\n' && line != buffer + BUFSIZ )
+        for ( ++line; *line != '"'; ++line )
         {
-            if ( !isdigit( *line ) )
+            if ( *line == '\\' )
             {
                 ++line;
-                continue;
             }
 
-            if ( image_size > MAX_IMAGE_SIZE )
+            if ( *line < 33 || *line > 96 )
             {
-                fputs( "Error: Image is too big.\n", stderr );
+                fputs( "Error: Bad image data format\n", stderr );
                 return 0;
             }
 
-            uint8_t color = (uint8_t)strtoul(line, &line, 10 );
+            chars[nchars++] = *line - 33;
+
+            if ( nchars == 4 )
+            {
+                if ( image_size == MAX_IMAGE_SIZE )
+                {
+                    fputs( "Error: Image is too big.\n", stderr );
+                    return 0;
+                }
+
+                uint8_t r = chars[0] << 2 | chars[1] >> 4;
+                uint8_t g = ( chars[1] & 0xF ) << 4 | chars[2] >> 2;
+                uint8_t b = ( chars[2] & 0x3 ) << 6 | chars[3];
 
-            if ( errno )
+                luma[image_size++] = dither_luma( r, g, b );
+                nchars = 0;
+            }
+        }
+
+        if ( strchr( line, ';' ) )
+        {
+            if ( nchars )
             {
-                perror( "Error: Bad image data format" );
+                fputs( "Error: Bad image data format\n", stderr );
                 return 0;
             }
 
-            image[image_size++] = cmap[color];
+            return image_size;
+        }
+    }
+
+    fputs( "Error: Can't find image data end\n", stderr );
+    return 0;
+}
+
+bool check_dimensions( uint32_t x_size, uint32_t y_size )
+{
+    printf( "Image dimensions: %ux%u pixels\n", x_size, y_size );
+
+    if ( ! x_size || ! y_size )
+    {
+        fputs( "Error: Image is empty\n", stderr );
+        return false;
+    }
+
+    if ( x_size > MAX_COL_BYTES * 8 || y_size > MAX_ROWS )
+    {
+        fprintf( stderr, "Error: Max. image size is %ux%u\n", MAX_COL_BYTES * 8, MAX_ROWS );
+        return false;
+    }
+
+    return true;
+}
+
+int read_xcf( FILE *image_file, color_t *palette, int ncolors, uint8_t *image, uint16_t *x_size, uint16_t *y_size )
+{
+    xcf_image_t xcf;
+    uint8_t cmap[XCF_MAX_COLORS];
+    int image_size = 0;
+
+    if ( ! xcf_read( image_file, &xcf ) )
+    {
+        return 0;
+    }
+
+    if ( ! check_dimensions( xcf.width, xcf.height ) )
+    {
+        goto out;
+    }
 
+    *x_size = xcf.width;
+    *y_size = xcf.height;
+
+    // As for GIMP headers in translate_cmap(), the colormap must have as many
+    // colors as the palette, all of them in it
+    if ( xcf.ncolors < ncolors )
+    {
+        fputs( "Error: Palette does not match\n", stderr );
+        goto out;
+    }
+
+    for ( int c = 0; c < ncolors; ++c )
+    {
+        if ( ncolors == ( cmap[c] = find_color( palette, ncolors, xcf.cmap[c][0], xcf.cmap[c][1], xcf.cmap[c][2] ) ) )
+        {
+            fputs( "Error: Palette does not match\n", stderr );
+            goto out;
         }
+    }
 
-        if ( *line != '\n' )
+    for ( int pixel = 0; pixel < *x_size * *y_size; ++pixel )
+    {
+        if ( xcf.pixels[pixel] >= ncolors )
         {
             fputs( "Error: Bad image data format\n", stderr );
-            return 0;
+            goto out;
         }
 
+        image[pixel] = cmap[xcf.pixels[pixel]];
     }
 
-    fputs( "Error: Can't find image data end\n", stderr );
-    return 0;
+    image_size = *x_size * *y_size;
+
+out:
+    xcf_free( &xcf );
+
+    return image_size;
 }
 
-int convert_to_layers( uint8_t *raw, uint8_t *binary, int color_bits, uint16_t x_size, uint16_t y_size )
+static int pack_bitwise( uint8_t *raw, uint8_t *binary, int color_bits, uint16_t x_size, uint16_t y_size )
 {
 
     int conv_byte = 0, data_size = 0;
 
-    printf( "Color bits: %d\n", color_bits );
-    
     for ( uint16_t y = 0; y < y_size; ++y )
     {
         for ( uint16_t x = 0; x < x_size; x += 8 )
@@ -319,23 +681,54 @@ int convert_to_layers( uint8_t *raw, uint8_t *binary, int color_bits, uint16_t x
     return data_size;
 }
 
-#define BYTES_PER_LINE 16
-bool output_asm( uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size )
+#define LOW_BITS 0x0101010101010101ULL
+#define GATHER_BITS 0x8040201008040201ULL
+
+// Same as pack_bitwise(), eight pixels at a time: a 64-bit word holds them, one
+// per byte, and for every plane the multiplication gathers bit cbit of each
+// byte into the top byte, first pixel in the most significant bit
+static int pack_transpose( uint8_t *raw, uint8_t *binary, int color_bits, uint16_t x_size, uint16_t y_size )
 {
-    FILE *output_file = fopen( options->output_filename, "w" );
+    int conv_byte = 0;
 
-    if ( NULL == output_file )
+    for ( uint16_t y = 0; y < y_size; ++y )
     {
-        perror( "Error opening output file" );
-        return false;
+        for ( uint16_t x = 0; x < x_size; x += 8 )
+        {
+            uint64_t pixels = 0;
+
+            memcpy( &pixels, raw + y * x_size + x, x_size - x < 8 ? x_size - x : 8 );
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            pixels = __builtin_bswap64( pixels );
+#endif
+            for ( int cbit = 0; cbit < color_bits; ++cbit )
+            {
+                binary[conv_byte + CARD_MEMORY_SIZE * cbit] = ( ( ( pixels >> cbit ) & LOW_BITS ) * GATHER_BITS ) >> 56;
+            }
+            ++conv_byte;
+        }
     }
 
+    return conv_byte * color_bits;
+}
+
+typedef int (*pack_kernel_fn)( uint8_t *raw, uint8_t *binary, int color_bits, uint16_t x_size, uint16_t y_size );
+
+static const pack_kernel_fn pack_kernels[KERNEL_VARIANTS] = { pack_bitwise, pack_transpose };
+
+int convert_to_layers( uint8_t *raw, uint8_t *binary, int color_bits, uint16_t x_size, uint16_t y_size, int kernel )
+{
+    return pack_kernels[kernel]( raw, binary, color_bits, x_size, y_size );
+}
+
+#define BYTES_PER_LINE 16
+bool output_asm( FILE *output_file, uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size )
+{
     fprintf( output_file, "X_SIZE\t= %u\n", x_size );
     fprintf( output_file, "Y_SIZE\t= %u\n", y_size );
 
     for ( int cbit = 0; cbit < color_bits; ++cbit )
     {
-        static const char *card_name[] = { "MASTER", "SLAVE_1", "SLAVE_2", "SLAVE_3" };
         uint16_t cbit_offset = cbit * CARD_MEMORY_SIZE;
 
         fprintf( output_file, "\n\n%s:", card_name[cbit] );
@@ -354,79 +747,633 @@ bool output_asm( uint8_t *data, options_t *options, int data_size, int color_bit
             }
         }
     }
-        
-    fclose( output_file );
+
+    // Payloads go with their load address, to be copied there
+    for ( int p = 0; p < options->npayloads; ++p )
+    {
+        pack_payload_t *payload = &options->payloads[p];
+
+        fprintf( output_file, "\n\n%s_ADDR\t= $%4.4X\n", payload->symbol, payload->address );
+        fprintf( output_file, "%s_SIZE\t= %u\n", payload->symbol, payload->size );
+        fprintf( output_file, "\n%s:", payload->symbol );
+
+        for ( int bytenum = 0; bytenum < payload->size; ++bytenum )
+        {
+            fprintf( output_file, bytenum % BYTES_PER_LINE ? ", $%2.2x" : "\n\t\t.BYTE\t$%2.2x", payload->data[bytenum] );
+        }
+    }
 
     return true;
 }
 
+bool output_o65( FILE *output_file, uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size )
+{
+    o65_export_t exports[MAX_CARDS + 2] = {
+        { "X_SIZE", O65_SEG_ABS, x_size },
+        { "Y_SIZE", O65_SEG_ABS, y_size }
+    };
+    int nexports = 2;
+    bool result;
+
+    result = o65_header( output_file, basename( options->output_filename ), data_size );
+
+    // Planes are stored consecutively in the data segment, each one exported
+    // with the same name used by output_asm()
+    for ( int cbit = 0; result && cbit < color_bits; ++cbit )
+    {
+        uint16_t plane_size = data_size / color_bits;
+
+        exports[nexports].name = card_name[cbit];
+        exports[nexports].segment = O65_SEG_DATA;
+        exports[nexports].value = cbit * plane_size;
+        ++nexports;
+
+        result = o65_write( output_file, data + cbit * CARD_MEMORY_SIZE, plane_size );
+    }
+
+    if ( result )
+    {
+        result = o65_terminate( output_file, exports, nexports );
+    }
+
+    return result;
+}
+
 typedef uint16_t (*hex_write_fn)( FILE *output_file, uint16_t address, uint8_t *data, size_t data_size );
 typedef bool (*hex_terminate_fn)( FILE *output_file, uint16_t lines );
 
-bool output_hex( hex_write_fn write_fn, hex_terminate_fn terminate_fn, uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size )
+#define SPARSE_MIN_GAP 8
+
+// Writes a block of data. For sparse output, runs of SPARSE_MIN_GAP or more
+// zero bytes are skipped, as they are cheaper to leave out than to send. With
+// a reference, bytes equal to it are skipped the same way.
+static bool unchanged( const uint8_t *data, const uint8_t *reference, size_t offset )
 {
-    FILE *output_file = fopen( options->output_filename, "w" );
-    uint16_t lines = 0;
+    return reference ? data[offset] == reference[offset] : !data[offset];
+}
 
-    if ( NULL == output_file )
+bool write_hex_block( FILE *output_file, hex_write_fn write_fn, uint16_t address, uint8_t *data, const uint8_t *reference, size_t data_size, bool sparse, uint16_t *lines )
+{
+    size_t start = 0, end;
+
+    while ( start < data_size )
     {
-        perror( "Error opening output file" );
-        return false;
+        end = data_size;
+
+        if ( sparse || reference )
+        {
+            int zeros = 0;
+
+            for ( ; start < data_size && unchanged( data, reference, start ); ++start );
+
+            if ( start == data_size )
+            {
+                break;
+            }
+
+            for ( end = start; end < data_size; ++end )
+            {
+                zeros = unchanged( data, reference, end ) ? zeros + 1 : 0;
+
+                if ( zeros == SPARSE_MIN_GAP )
+                {
+                    end -= SPARSE_MIN_GAP - 1;
+                    break;
+                }
+            }
+
+            for ( ; unchanged( data, reference, end - 1 ); --end );
+        }
+
+        uint16_t retlines = write_fn( output_file, address + start, data + start, end - start );
+
+        if ( ! retlines )
+        {
+            return false;
+        }
+        *lines += retlines;
+        start = end;
     }
 
+    return true;
+}
+
+bool output_hex( FILE *output_file, hex_write_fn write_fn, hex_terminate_fn terminate_fn, uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size )
+{
+    const uint8_t *reference = options->reference;
+    uint16_t lines = 0;
+
     for ( int cbit = 0; cbit < color_bits; ++cbit )
     {
         uint16_t cbit_offset = cbit * CARD_MEMORY_SIZE;
-        uint16_t retlines;
 
+        // Full rows are contiguous in card memory, so every plane goes at once
         if ( x_size > ( MAX_COL_BYTES - 1 ) * 8 )
         {
-            retlines = write_fn( output_file, options->base_address + cbit_offset, data + cbit_offset, data_size );
-            if ( ! retlines )
+            if ( ! write_hex_block( output_file, write_fn, options->base_address + cbit_offset, data + cbit_offset, reference ? reference + cbit_offset : NULL, data_size / color_bits, options->sparse, &lines ) )
             {
-                fclose( output_file );
                 return false;
             }
-            lines += retlines;
         }
         else
         {
             for ( uint16_t linenum = 0; linenum < y_size; ++linenum )
             {
                 uint16_t line_offset = linenum * MAX_COL_BYTES;
-                retlines = write_fn( output_file, options->base_address + cbit_offset + line_offset, data + cbit_offset + linenum*((x_size+7)/8), (x_size+7)/8 );
-                
-                if ( ! retlines )
+
+                uint16_t data_offset = cbit_offset + linenum*((x_size+7)/8);
+
+                if ( ! write_hex_block( output_file, write_fn, options->base_address + cbit_offset + line_offset, data + data_offset, reference ? reference + data_offset : NULL, (x_size+7)/8, options->sparse, &lines ) )
                 {
-                    fclose( output_file );
                     return false;
                 }
-                lines += retlines;
             }
         }
     }
+
+    // Deltas don't repeat the payloads, they were loaded with the full image
+    for ( int p = 0; NULL == reference && p < options->npayloads; ++p )
+    {
+        pack_payload_t *payload = &options->payloads[p];
+
+        if ( ! write_hex_block( output_file, write_fn, payload->address, payload->data, NULL, payload->size, options->sparse, &lines ) )
+        {
+            return false;
+        }
+    }
     
-    bool result = terminate_fn( output_file, lines );
-    
+    return terminate_fn( output_file, lines );
+}
+
+bool output_ihex( FILE *output_file, uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size )
+{
+    static const hex_write_fn ihex_kernels[KERNEL_VARIANTS] = { ihex_write, ihex_write_table };
+
+    return output_hex( output_file, ihex_kernels[options->kernels[KERNEL_HEX]], ihex_terminate, data, options, data_size, color_bits, x_size, y_size );
+}
+
+bool output_pap( FILE *output_file, uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size )
+{
+    static const hex_write_fn pap_kernels[KERNEL_VARIANTS] = { pap_write, pap_write_table };
+
+    return output_hex( output_file, pap_kernels[options->kernels[KERNEL_HEX]], pap_terminate, data, options, data_size, color_bits, x_size, y_size );
+}
+
+static const int rd_strengths[] = { 100, 75, 50, 25, 0 };
+static const int rd_snaps[] = { 0, 12, 24, 36, 48 };
+// Percentages of the temporal threshold, only searched with a previous frame
+static const int rd_thresholds[] = { 100, 0, 50, 200 };
+
+#define RD_NSTRENGTHS ( sizeof( rd_strengths ) / sizeof( rd_strengths[0] ) )
+#define RD_NSNAPS ( sizeof( rd_snaps ) / sizeof( rd_snaps[0] ) )
+#define RD_NTHRESHOLDS ( sizeof( rd_thresholds ) / sizeof( rd_thresholds[0] ) )
+#define SSIM_BLOCK 8
+#define BLUR_RADIUS 2
+
+typedef struct {
+    dither_params_t params;
+    uint8_t *image;
+    dither_history_t history;
+    size_t cost;
+    double ssim;
+    int kept;
+    bool ok;
+} rd_candidate_t;
+
+typedef struct {
+    options_t *options;
+    const dither_levels_t *levels;
+    const uint8_t *luma;
+    const uint8_t *blurred_luma;
+    const uint8_t *palette_luma;
+    int color_bits;
+    uint16_t x_size;
+    uint16_t y_size;
+    rd_candidate_t *candidates;
+} rd_ctx_t;
+
+// Box filter, as a rough model of how the dither pattern is seen from a distance
+static void box_blur( const uint8_t *in, uint8_t *out, uint16_t x_size, uint16_t y_size )
+{
+    for ( int y = 0; y < y_size; ++y )
+    {
+        for ( int x = 0; x < x_size; ++x )
+        {
+            int sum = 0, count = 0;
+
+            for ( int dy = -BLUR_RADIUS; dy <= BLUR_RADIUS; ++dy )
+            {
+                for ( int dx = -BLUR_RADIUS; dx <= BLUR_RADIUS; ++dx )
+                {
+                    if ( y + dy >= 0 && y + dy < y_size && x + dx >= 0 && x + dx < x_size )
+                    {
+                        sum += in[( y + dy ) * x_size + x + dx];
+                        ++count;
+                    }
+                }
+            }
+
+            out[y * x_size + x] = ( sum + count / 2 ) / count;
+        }
+    }
+}
+
+// Mean SSIM over SSIM_BLOCK x SSIM_BLOCK windows
+static double ssim( const uint8_t *a, const uint8_t *b, uint16_t x_size, uint16_t y_size )
+{
+    static const double c1 = ( 0.01 * 255 ) * ( 0.01 * 255 );
+    static const double c2 = ( 0.03 * 255 ) * ( 0.03 * 255 );
+    double total = 0;
+    int nblocks = 0;
+
+    for ( int by = 0; by < y_size; by += SSIM_BLOCK )
+    {
+        for ( int bx = 0; bx < x_size; bx += SSIM_BLOCK )
+        {
+            double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+            int n = 0;
+
+            for ( int y = by; y < by + SSIM_BLOCK && y < y_size; ++y )
+            {
+                for ( int x = bx; x < bx + SSIM_BLOCK && x < x_size; ++x )
+                {
+                    double va = a[y * x_size + x], vb = b[y * x_size + x];
+
+                    sa += va;
+                    sb += vb;
+                    saa += va * va;
+                    sbb += vb * vb;
+                    sab += va * vb;
+                    ++n;
+                }
+            }
+
+            double ma = sa / n, mb = sb / n;
+            double va = saa / n - ma * ma, vb = sbb / n - mb * mb, cov = sab / n - ma * mb;
+
+            total += ( ( 2 * ma * mb + c1 ) * ( 2 * cov + c2 ) ) / ( ( ma * ma + mb * mb + c1 ) * ( va + vb + c2 ) );
+            ++nblocks;
+        }
+    }
+
+    return total / nblocks;
+}
+
+static void rd_evaluate( void *arg, int job )
+{
+    rd_ctx_t *ctx = arg;
+    rd_candidate_t *candidate = &ctx->candidates[job];
+    int npixels = ctx->x_size * ctx->y_size;
+    uint8_t *converted = calloc( MAX_CARDS, CARD_MEMORY_SIZE );
+    uint8_t *output_luma = malloc( npixels * 2 );
+    char *output_buffer = NULL;
+    size_t output_size = 0;
+    FILE *output_file;
+
+    if ( NULL == converted || NULL == output_luma )
+    {
+        goto out;
+    }
+
+    candidate->kept = dither_image( ctx->levels, ctx->luma, candidate->image, ctx->x_size, ctx->y_size,
+                                    candidate->history.luma ? &candidate->history : NULL, &candidate->params );
+
+    int data_size = convert_to_layers( candidate->image, converted, ctx->color_bits, ctx->x_size, ctx->y_size, ctx->options->kernels[KERNEL_PACK] );
+
+    // The cost is the size of the actual encoder output
+    if ( NULL == ( output_file = open_memstream( &output_buffer, &output_size ) ) )
+    {
+        goto out;
+    }
+
+    candidate->ok = ctx->options->format->output_fn( output_file, converted, ctx->options, data_size, ctx->color_bits, ctx->x_size, ctx->y_size );
+
     fclose( output_file );
+    free( output_buffer );
+
+    candidate->cost = output_size;
+
+    for ( int pixel = 0; pixel < npixels; ++pixel )
+    {
+        output_luma[pixel] = ctx->palette_luma[candidate->image[pixel]];
+    }
+    box_blur( output_luma, output_luma + npixels, ctx->x_size, ctx->y_size );
+
+    candidate->ssim = ssim( ctx->blurred_luma, output_luma + npixels, ctx->x_size, ctx->y_size );
+
+out:
+    free( output_luma );
+    free( converted );
+}
+
+// Searches the dither strengths and background snapping distances for the
+// result with the best SSIM against the source whose output fits the budget
+bool rd_dither( options_t *options, const dither_levels_t *levels, const uint8_t *palette_luma, const uint8_t *luma, uint8_t *image, uint16_t x_size, uint16_t y_size, int color_bits, dither_history_t *history )
+{
+    int npixels = x_size * y_size;
+    bool temporal = options->temporal_threshold && history->valid;
+    // Without a previous frame, the threshold makes no difference
+    int nthresholds = temporal ? RD_NTHRESHOLDS : 1;
+    int ncandidates = RD_NSTRENGTHS * RD_NSNAPS * nthresholds;
+    rd_candidate_t *candidates = calloc( ncandidates, sizeof( rd_candidate_t ) );
+    uint8_t *blurred_luma = malloc( npixels );
+    rd_candidate_t *best = NULL, *smallest = NULL;
+    bool result = false;
+
+    if ( NULL == candidates || NULL == blurred_luma )
+    {
+        perror( "Error: Can't allocate dithering candidates" );
+        goto out;
+    }
+
+    for ( int c = 0; c < ncandidates; ++c )
+    {
+        rd_candidate_t *candidate = &candidates[c];
+
+        int threshold = options->temporal_threshold * rd_thresholds[c % nthresholds] / 100;
+
+        candidate->params.strength = rd_strengths[c / nthresholds / RD_NSNAPS];
+        candidate->params.snap = rd_snaps[c / nthresholds % RD_NSNAPS];
+        candidate->params.threshold = threshold > 255 ? 255 : threshold;
+
+        if ( NULL == ( candidate->image = malloc( npixels ) ) )
+        {
+            perror( "Error: Can't allocate dithering candidates" );
+            goto out;
+        }
+
+        // Every candidate starts from its own copy of the previous frame
+        if ( temporal )
+        {
+            candidate->history = *history;
+            candidate->history.luma = malloc( npixels );
+            candidate->history.image = malloc( npixels );
+
+            if ( NULL == candidate->history.luma || NULL == candidate->history.image )
+            {
+                perror( "Error: Can't allocate dithering candidates" );
+                goto out;
+            }
+            memcpy( candidate->history.luma, history->luma, npixels );
+            memcpy( candidate->history.image, history->image, npixels );
+        }
+    }
+
+    box_blur( luma, blurred_luma, x_size, y_size );
+
+    rd_ctx_t ctx = { options, levels, luma, blurred_luma, palette_luma, color_bits, x_size, y_size, candidates };
+
+    parallel_run( ncandidates, rd_evaluate, &ctx );
+
+    for ( int c = 0; c < ncandidates; ++c )
+    {
+        rd_candidate_t *candidate = &candidates[c];
+
+        if ( ! candidate->ok )
+        {
+            fputs( "Error: Can't evaluate dithering candidates\n", stderr );
+            goto out;
+        }
+
+        if ( NULL == smallest || candidate->cost < smallest->cost )
+        {
+            smallest = candidate;
+        }
+
+        if ( candidate->cost <= options->budget && ( NULL == best || candidate->ssim > best->ssim ) )
+        {
+            best = candidate;
+        }
+    }
+
+    if ( NULL == best )
+    {
+        fprintf( stderr, "Error: No dithering fits the budget of %zu bytes (min. is %zu)\n", options->budget, smallest->cost );
+        goto out;
+    }
+
+    printf( "Dithering: strength %d%%, snap %d, threshold %d, %zu bytes, SSIM %.4f\n",
+            best->params.strength, best->params.snap, best->params.threshold, best->cost, best->ssim );
+
+    if ( options->temporal_threshold )
+    {
+        printf( "Dithering: kept %d pixels from previous frame\n", best->kept );
+    }
+
+    memcpy( image, best->image, npixels );
+
+    if ( temporal )
+    {
+        memcpy( history->luma, best->history.luma, npixels );
+        memcpy( history->image, best->history.image, npixels );
+    }
+    else
+    {
+        // Record the chosen frame for the next one
+        dither_image( levels, luma, image, x_size, y_size, history, &best->params );
+    }
+
+    result = true;
+
+out:
+    for ( int c = 0; candidates && c < ncandidates; ++c )
+    {
+        free( candidates[c].image );
+        free( candidates[c].history.luma );
+        free( candidates[c].history.image );
+    }
+    free( candidates );
+    free( blurred_luma );
 
     return result;
 }
 
-bool output_ihex( uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size )
+// Runs the copy routine for every plane on a simulated 6502 and checks that
+// the card memory ends up with the same contents that output_hex() loads
+bool simulate_copy( uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size )
+{
+    static uint8_t memory[M6502_MEMORY_SIZE];
+    uint16_t row_bytes = ( x_size + 7 ) / 8;
+    uint32_t plane_size = row_bytes * y_size;
+    uint64_t cycles = 0;
+    m6502_t cpu;
+
+    for ( int cbit = 0; cbit < color_bits; ++cbit )
+    {
+        uint8_t *plane = data + cbit * CARD_MEMORY_SIZE;
+        uint32_t card = options->base_address + cbit * CARD_MEMORY_SIZE;
+
+        if ( card + CARD_MEMORY_SIZE > M6502_MEMORY_SIZE )
+        {
+            fprintf( stderr, "Error: Card %d is outside of the 6502 address space\n", cbit );
+            return false;
+        }
+
+        if ( ! copy_plane( &cpu, memory, plane, copy_source( card, plane_size ), card, row_bytes, y_size ) )
+        {
+            fputs( "Error: Simulated copy routine did not return\n", stderr );
+            return false;
+        }
+
+        cycles += cpu.cycles;
+
+        for ( uint16_t row = 0; row < y_size; ++row )
+        {
+            if ( memcmp( memory + card + row * MAX_COL_BYTES, plane + row * row_bytes, row_bytes ) )
+            {
+                fprintf( stderr, "Error: Simulated card %d memory does not match at row %u\n", cbit, row );
+                return false;
+            }
+        }
+    }
+
+    printf( "Simulated copy: %llu cycles, %.2f cycles/byte\n", (unsigned long long) cycles, (double) cycles / data_size );
+
+    return true;
+}
+
+// Writes the file only if its contents would change, so that its modification
+// time is preserved for make. With a journal, the file is added to the job.
+bool update_file( const char *file_name, const char *data, size_t data_size, journal_t *journal )
+{
+    FILE *file = fopen( file_name, "rb" );
+
+    if ( NULL != file )
+    {
+        bool unchanged = true;
+        char buffer[BUFSIZ];
+        size_t offset = 0, nbytes;
+
+        while ( unchanged && 0 != ( nbytes = fread( buffer, 1, sizeof( buffer ), file ) ) )
+        {
+            unchanged = offset + nbytes <= data_size && !memcmp( buffer, data + offset, nbytes );
+            offset += nbytes;
+        }
+
+        fclose( file );
+
+        if ( unchanged && offset == data_size )
+        {
+            printf( "'%s' is up to date\n", file_name );
+            return NULL == journal || journal_add_file( journal, file_name, data, data_size );
+        }
+    }
+
+    // Written to a temporary file and renamed, so a crash never leaves a
+    // partial file behind
+    char *temp_name = malloc( strlen( file_name ) + sizeof( ".XXXXXX" ) );
+    mode_t mask = umask( 0 );
+    int fd;
+
+    umask( mask );
+
+    if ( NULL == temp_name )
+    {
+        perror( "Error: Can't allocate temporary file name" );
+        return false;
+    }
+
+    strcat( strcpy( temp_name, file_name ), ".XXXXXX" );
+
+    if ( 0 > ( fd = mkstemp( temp_name ) ) || NULL == ( file = fdopen( fd, "wb" ) ) )
+    {
+        perror( "Error opening output file" );
+        if ( fd >= 0 )
+        {
+            close( fd );
+            unlink( temp_name );
+        }
+        free( temp_name );
+        return false;
+    }
+
+    if ( fchmod( fd, 0666 & ~mask ) )
+    {
+        perror( "Error setting output file permissions" );
+        fclose( file );
+        unlink( temp_name );
+        free( temp_name );
+        return false;
+    }
+
+    bool result = data_size == fwrite( data, 1, data_size, file );
+
+    if ( EOF == fclose( file ) || ! result )
+    {
+        perror( "Error writing to file" );
+        result = false;
+    }
+    else if ( rename( temp_name, file_name ) )
+    {
+        perror( "Error renaming output file" );
+        result = false;
+    }
+
+    if ( ! result )
+    {
+        unlink( temp_name );
+    }
+
+    free( temp_name );
+
+    return result && ( NULL == journal || journal_add_file( journal, file_name, data, data_size ) );
+}
+
+static void put_make_name( FILE *file, const char *name )
 {
-    return output_hex( ihex_write, ihex_terminate, data, options, data_size, color_bits, x_size, y_size );
+    for ( ; *name; ++name )
+    {
+        if ( *name == ' ' || *name == '\t' || *name == '#' )
+        {
+            fputc( '\\', file );
+        }
+        else if ( *name == '$' )
+        {
+            fputc( '$', file );
+        }
+        fputc( *name, file );
+    }
 }
 
-bool output_pap( uint8_t *data, options_t *options, int data_size, int color_bits, uint16_t x_size, uint16_t y_size )
+// Writes a make rule like "gcc -MD -MP" does: one rule for all the generated
+// targets and an empty rule for every prerequisite, so that make does not fail
+// if any of them is removed
+void write_dep_rule( FILE *dep_file, char **targets, int ntargets, char **prereqs, int nprereqs )
 {
-    return output_hex( pap_write, pap_terminate, data, options, data_size, color_bits, x_size, y_size );
+    for ( int t = 0; t < ntargets; ++t )
+    {
+        if ( t )
+        {
+            fputc( ' ', dep_file );
+        }
+        put_make_name( dep_file, targets[t] );
+    }
+    fputc( ':', dep_file );
+
+    for ( int p = 0; p < nprereqs; ++p )
+    {
+        fputs( " \\\n ", dep_file );
+        put_make_name( dep_file, prereqs[p] );
+    }
+    fputc( '\n', dep_file );
+
+    for ( int p = 0; p < nprereqs; ++p )
+    {
+        fputc( '\n', dep_file );
+        put_make_name( dep_file, prereqs[p] );
+        fputs( ":\n", dep_file );
+    }
 }
 
 void usage( char *myname )
 {
     fprintf( stderr, "\nUsage: %s -i <input_file> [ -o <output_file> ] [-p <palette_file>] \\\n", basename( myname ) );
-    fputs( "\t\t[ -f <format> ] [ -a <hex_base_addr> ]\n\n", stderr );
+    fputs( "\t\t[ -f <format> ] [ -a <hex_base_addr> ] [ -d <dep_file> ] \\\n", stderr );
+    fputs( "\t\t[ -t <threshold> ] [ -s ] [ -z ] [ -b <budget>[s] ] [ -B <baud_rate> ] \\\n", stderr );
+    fputs( "\t\t[ -S <serial_port> ... ] [ -w <char_delay> ] [ -E ] [ -O <order_file> ] \\\n", stderr );
+    fputs( "\t\t[ -j <journal_file> ] [ -x <payload_file> ... ] [ --stats ] \\\n", stderr );
+    fputs( "\t\t[ <input_file> ... ]\n", stderr );
+    fprintf( stderr, "       %s --tune\n\n", basename( myname ) );
 
     fputs( "\tSupported formats:\n\n", stderr );
     for ( int f = 0; formats[f].format_string != NULL; ++f )
@@ -434,28 +1381,91 @@ void usage( char *myname )
         fprintf( stderr, "\t%s\t- %s\n", formats[f].format_string, formats[f].format_des );
     }
     fputs( "\n- If no output file is specified, same as input file with the appropriate\n", stderr );
-    fputs( "  extension will be used.\n", stderr );
+    fputs( "  extension will be used. It can't be specified for multiple input files.\n", stderr );
     fputs( "\n- If no palette file is specified, 1-bit black & white is assumed.\n", stderr );
     fprintf( stderr, "\n- Default base address is %4.4X. Min. is %4.4X, max. is %4.4X.\n", DEFAULT_BASE_ADDRESS, MIN_BASE_ADDRESS, MAX_BASE_ADDRESS );
+    fputs( "\n- If a dependency file is specified, a make rule for every output file is\n", stderr );
+    fputs( "  written to it.\n", stderr );
+    fputs( "\n- RGB images are dithered to the palette. With a temporal threshold, input\n", stderr );
+    fputs( "  files are frames of an animation and pixels whose source changed less than\n", stderr );
+    fputs( "  the threshold keep the previous frame's output.\n", stderr );
+    fputs( "\n- With -s, a 6502 routine copying the planes to card memory is run on a\n", stderr );
+    fputs( "  simulated CPU to verify the data and report its cycle count.\n", stderr );
+    fputs( "\n- With -z, hex output skips runs of zero bytes. Card memory must be cleared\n", stderr );
+    fputs( "  before loading.\n", stderr );
+    fprintf( stderr, "\n- The budget is the max. output size in bytes, or in seconds at the baud\n" );
+    fprintf( stderr, "  rate (default %u) if followed by 's'. RGB images are dithered with the\n", DEFAULT_BAUD_RATE );
+    fputs( "  best quality that fits it.\n", stderr );
+    fputs( "\n- Every -S sends the pap or ihex output to that serial port at the baud\n", stderr );
+    fputs( "  rate, all ports at once. The char delay is in milliseconds. Records are\n", stderr );
+    fputs( "  verified against the KIM-1 echo and resent on errors, unless -E is given.\n", stderr );
+    fputs( "\n- With -O, the input files are a slideshow. They are ordered so that the\n", stderr );
+    fputs( "  changes between them are minimal, a pap or ihex delta from the previous\n", stderr );
+    fputs( "  image is written for each one and the order is written to the order file.\n", stderr );
+    fputs( "\n- With a journal file, completed conversions are recorded and skipped when\n", stderr );
+    fputs( "  run again if the input, options and output file are unchanged.\n", stderr );
+    fputs( "\n- Every -x adds a payload file to the card memory the image does not use.\n", stderr );
+    fputs( "  Their addresses are written to a map file named like the output file.\n", stderr );
+    fputs( "\n- --tune times the variants of the parse, pack and hex kernels on this CPU\n", stderr );
+    fputs( "  and writes the fastest ones to the profile file ($KIMG_PROFILE or\n", stderr );
+    fputs( "  ~/.kimg_profile). --stats shows the kernels used for every image.\n", stderr );
 }
 
+enum { OPT_TUNE = 256, OPT_STATS };
+
+static const struct option long_options[] = {
+    { "tune", no_argument, NULL, OPT_TUNE },
+    { "stats", no_argument, NULL, OPT_STATS },
+    { NULL, 0, NULL, 0 }
+};
+
 bool get_options( int argc, char **argv, options_t *options )
 {
     int c;
     char *cvalue = NULL;
+    double budget = 0;
+    bool budget_seconds = false;
 
     options->base_address = DEFAULT_BASE_ADDRESS;
-    options->input_filename = NULL;
+    options->input_filenames = calloc( argc, sizeof( char * ) );
+    options->ninputs = 0;
     options->output_filename = NULL;
     options->palette_filename = NULL;
+    options->dep_filename = NULL;
+    options->temporal_threshold = 0;
+    options->simulate = false;
+    options->sparse = false;
+    options->budget = 0;
+    options->baud_rate = DEFAULT_BAUD_RATE;
+    options->port_names = calloc( argc, sizeof( char * ) );
+    options->nports = 0;
+    options->char_delay = 0;
+    options->verify_echo = true;
+    options->order_filename = NULL;
+    options->reference = NULL;
+    options->journal_filename = NULL;
+    options->journal = NULL;
+    options->options_hash = JOURNAL_HASH_INIT;
+    options->payload_filenames = calloc( argc, sizeof( char * ) );
+    options->npayloads = 0;
+    options->payloads = NULL;
+    options->tune = false;
+    options->stats = false;
+    memset( options->kernels, 0, sizeof( options->kernels ) );
     options->format = &formats[0];
 
-    while (( c = getopt( argc, argv, "i:o:p:f:a:h?")) != -1 )
+    if ( NULL == options->input_filenames || NULL == options->port_names || NULL == options->payload_filenames )
+    {
+        perror( "Error: Can't allocate input file list" );
+        return false;
+    }
+
+    while (( c = getopt_long( argc, argv, "i:o:p:f:a:d:t:szb:B:S:w:EO:j:x:h?", long_options, NULL )) != -1 )
     {
         switch( c )
         {
             case 'i':
-                options->input_filename = optarg;
+                options->input_filenames[options->ninputs++] = optarg;
                 break;
 
             case 'o':
@@ -465,6 +1475,83 @@ bool get_options( int argc, char **argv, options_t *options )
             case 'p':
                 options->palette_filename = optarg;
                 break;
+
+            case 'd':
+                options->dep_filename = optarg;
+                break;
+
+            case 's':
+                options->simulate = true;
+                break;
+
+            case 'z':
+                options->sparse = true;
+                break;
+
+            case 'b':
+                budget = strtod( optarg, &cvalue );
+                budget_seconds = !strcmp( cvalue, "s" );
+                if ( budget <= 0 || ( *cvalue && !budget_seconds ) )
+                {
+                    fputs( "Invalid budget.\n", stderr );
+                    return false;
+                }
+                break;
+
+            case 'B':
+                options->baud_rate = (unsigned)strtoul( optarg, &cvalue, 10 );
+                if ( *cvalue || !options->baud_rate )
+                {
+                    fputs( "Invalid baud rate.\n", stderr );
+                    return false;
+                }
+                break;
+
+            case 'S':
+                options->port_names[options->nports++] = optarg;
+                break;
+
+            case 'w':
+                options->char_delay = (unsigned)strtoul( optarg, &cvalue, 10 );
+                if ( *cvalue )
+                {
+                    fputs( "Invalid char delay.\n", stderr );
+                    return false;
+                }
+                break;
+
+            case 'E':
+                options->verify_echo = false;
+                break;
+
+            case 'O':
+                options->order_filename = optarg;
+                break;
+
+            case 'j':
+                options->journal_filename = optarg;
+                break;
+
+            case 'x':
+                options->payload_filenames[options->npayloads++] = optarg;
+                break;
+
+            case OPT_TUNE:
+                options->tune = true;
+                break;
+
+            case OPT_STATS:
+                options->stats = true;
+                break;
+
+            case 't':
+                options->temporal_threshold = (int)strtoul( optarg, &cvalue, 10 );
+                if ( *cvalue || options->temporal_threshold > 255 )
+                {
+                    fputs( "Invalid temporal threshold.\n", stderr );
+                    return false;
+                }
+                break;
             
             case 'a':
                 options->base_address = (uint16_t)strtoul( optarg, NULL, 16 );
@@ -508,59 +1595,939 @@ bool get_options( int argc, char **argv, options_t *options )
 
     }
 
-    if ( NULL == options->input_filename )
+    // Serial transfers take 10 bits per character
+    options->budget = budget_seconds ? budget * options->baud_rate / 10 : budget;
+
+    while ( optind < argc )
+    {
+        options->input_filenames[options->ninputs++] = argv[optind++];
+    }
+
+    if ( options->tune )
+    {
+        return true;
+    }
+
+    if ( 0 == options->ninputs )
     {
         fprintf( stderr, "Error: Missing input file.\n" );
         return false;
     }
 
+    if ( options->ninputs > 1 && NULL != options->output_filename )
+    {
+        fprintf( stderr, "Error: Output file can't be specified with multiple input files.\n" );
+        return false;
+    }
+
+    if ( options->nports && ! options->format->records )
+    {
+        fprintf( stderr, "Error: Format %s can't be sent to a serial port.\n", options->format->format_string );
+        return false;
+    }
+
+    if ( NULL != options->order_filename && ( options->ninputs < 2 || ! options->format->records ) )
+    {
+        fputs( "Error: A slideshow needs several input files and pap or ihex format.\n", stderr );
+        return false;
+    }
+
+    if ( options->npayloads && options->format->output_fn == (output_fn_t) output_o65 )
+    {
+        fputs( "Error: Payloads can't be added to o65 output.\n", stderr );
+        return false;
+    }
+
+    // Those depend on the previous images, so single jobs can't be skipped
+    if ( NULL != options->journal_filename && ( options->temporal_threshold || NULL != options->order_filename ) )
+    {
+        fputs( "Error: A journal can't be used with a temporal threshold or a slideshow.\n", stderr );
+        return false;
+    }
+
+    // Skipped jobs produce no output to send or simulate
+    if ( NULL != options->journal_filename && ( options->nports || options->simulate ) )
+    {
+        fputs( "Error: A journal can't be used with serial sending or simulation.\n", stderr );
+        return false;
+    }
+
     return true;
 }
 
-int main( int argc, char **argv )
+char *make_output_filename( const char *input_filename, const char *extension )
+{
+    char *output_filename = malloc( strlen( input_filename ) + strlen( extension ) + 2 );
+
+    if ( NULL == output_filename )
+    {
+        perror( "Error: Can't allocate output filename" );
+        return NULL;
+    }
+
+    strcpy( output_filename, input_filename );
+    char *dot = strrchr ( output_filename, '.' );
+    if ( dot == NULL )
+    {
+        strcat( output_filename, "." );
+    }
+    else
+    {
+        *++dot = '\0';
+    }
+    strcat( output_filename, extension );
+
+    return output_filename;
+}
+
+static void add_dep_rule( options_t *options, char *input_filename, char *map_filename, FILE *dep_file )
+{
+    char *targets[] = { options->output_filename, map_filename };
+    char *prereqs[2 + options->npayloads];
+    int nprereqs = 0;
+
+    prereqs[nprereqs++] = input_filename;
+    if ( NULL != options->palette_filename )
+    {
+        prereqs[nprereqs++] = options->palette_filename;
+    }
+    for ( int p = 0; p < options->npayloads; ++p )
+    {
+        prereqs[nprereqs++] = options->payloads[p].file_name;
+    }
+
+    write_dep_rule( dep_file, targets, NULL == map_filename ? 1 : 2, prereqs, nprereqs );
+}
+
+// Free card memory: the tail of every row and everything below the image,
+// including the bytes past the screen, on every card used by the image
+static int free_regions( options_t *options, int color_bits, uint16_t x_size, uint16_t y_size, pack_region_t *regions )
+{
+    uint16_t row_bytes = ( x_size + 7 ) / 8;
+    int nregions = 0;
+
+    if ( row_bytes > MAX_COL_BYTES )
+    {
+        row_bytes = MAX_COL_BYTES;
+    }
+
+    for ( int cbit = 0; cbit < color_bits; ++cbit )
+    {
+        uint16_t card_address = options->base_address + cbit * CARD_MEMORY_SIZE;
+
+        for ( uint16_t linenum = 0; row_bytes < MAX_COL_BYTES && linenum < y_size; ++linenum )
+        {
+            regions[nregions].address = card_address + linenum * MAX_COL_BYTES + row_bytes;
+            regions[nregions].size = MAX_COL_BYTES - row_bytes;
+            ++nregions;
+        }
+
+        regions[nregions].address = card_address + y_size * MAX_COL_BYTES;
+        regions[nregions].size = CARD_MEMORY_SIZE - y_size * MAX_COL_BYTES;
+        ++nregions;
+    }
+
+    return nregions;
+}
+
+// Places the payloads for this image and writes their symbols to the map file
+static bool place_payloads( options_t *options, char *map_filename, int color_bits, uint16_t x_size, uint16_t y_size )
 {
+    pack_region_t regions[MAX_CARDS * ( MAX_ROWS + 1 )];
+    int nregions = free_regions( options, color_bits, x_size, y_size, regions );
+    char *map_buffer = NULL;
+    size_t map_size = 0;
+    FILE *map_file;
+
+    if ( ! pack_payloads( regions, nregions, options->payloads, options->npayloads ) )
+    {
+        return false;
+    }
+
+    if ( NULL == ( map_file = open_memstream( &map_buffer, &map_size ) ) )
+    {
+        perror( "Error: Can't allocate map file" );
+        return false;
+    }
+
+    fprintf( map_file, "; Payloads packed with '%s'\n", options->output_filename );
+
+    for ( int p = 0; p < options->npayloads; ++p )
+    {
+        pack_payload_t *payload = &options->payloads[p];
+
+        printf( "Payload '%s' at %4.4X, %u bytes\n", payload->file_name, payload->address, payload->size );
+        fprintf( map_file, "\n%s_ADDR\t= $%4.4X\n", payload->symbol, payload->address );
+        fprintf( map_file, "%s_SIZE\t= %u\n", payload->symbol, payload->size );
+    }
+
+    fclose( map_file );
+
+    bool result = update_file( map_filename, map_buffer, map_size, options->journal );
+
+    free( map_buffer );
+
+    return result;
+}
+
+// Checks that a file is in the journal for this job and is still the one that
+// was written then
+static bool journaled_file( options_t *options, uint64_t input_hash, const char *file_name )
+{
+    const journal_entry_t *entry = journal_find( options->journal, input_hash, options->options_hash, file_name );
+    uint64_t output_hash;
+    size_t output_size;
+
+    return     NULL != entry
+            && journal_hash_file( file_name, &output_hash, &output_size )
+            && output_size == entry->output_size && output_hash == entry->output_hash;
+}
+
+// A job is done if every file it writes is journaled
+static bool journaled( options_t *options, uint64_t input_hash, const char *map_filename )
+{
+    return     journaled_file( options, input_hash, options->output_filename )
+            && ( NULL == map_filename || journaled_file( options, input_hash, map_filename ) );
+}
+
+bool convert_file( options_t *options, char *input_filename, color_t *color_palette, int ncolors, uint8_t *palette_luma, dither_levels_t *levels, FILE *dep_file, slide_t *slide )
+{
+    static uint8_t raw_image[MAX_IMAGE_SIZE];
+    static uint8_t luma_image[MAX_IMAGE_SIZE];
+    static uint8_t converted_image[MAX_CARDS*CARD_MEMORY_SIZE];
+    static uint8_t history_luma[MAX_IMAGE_SIZE];
+    static uint8_t history_image[MAX_IMAGE_SIZE];
+    static dither_history_t history = { false, 0, 0, history_luma, history_image };
+    static uint8_t previous_image[MAX_CARDS*CARD_MEMORY_SIZE];
+    static int previous_data_size = 0;
+
     char read_buffer[BUFSIZ];
-    uint8_t raw_image[MAX_IMAGE_SIZE];
-    uint8_t converted_image[MAX_CARDS*CARD_MEMORY_SIZE];
-    color_t color_palette[MAX_PALETTE_SIZE] = { { 0, 0, 0}, {255, 255, 255} };
     uint8_t color_translation[MAX_PALETTE_SIZE];
 
-    options_t options;
-
     uint16_t x_size, y_size;
 
-    int ncolors = 2, color_bits, image_size, data_size;
+    int color_bits, image_size, data_size;
+
+    bool rgb = false, derived_filename = false;
+
+    uint64_t input_hash = 0;
+
+    char *map_filename = NULL;
+
+    bool tokenized = false;
 
     FILE *image_file;
+
+    if ( NULL == options->output_filename || options->ninputs > 1 )
+    {
+        derived_filename = true;
+
+        if ( NULL == ( options->output_filename = make_output_filename( input_filename, options->format->format_string ) ) )
+        {
+            return false;
+        }
+
+        printf( "Output file is '%s'\n", options->output_filename );
+    }
+
+    if ( options->npayloads && NULL == ( map_filename = make_output_filename( options->output_filename, "map" ) ) )
+    {
+        return false;
+    }
+
+    if ( NULL != options->journal )
+    {
+        size_t input_size;
+
+        if ( ! journal_hash_file( input_filename, &input_hash, &input_size ) )
+        {
+            perror( "Error opening image file" );
+            return false;
+        }
+
+        if ( journaled( options, input_hash, map_filename ) )
+        {
+            printf( "'%s' is already converted\n", options->output_filename );
+
+            if ( NULL != dep_file )
+            {
+                add_dep_rule( options, input_filename, map_filename, dep_file );
+            }
+
+            free( map_filename );
+
+            if ( derived_filename )
+            {
+                free( options->output_filename );
+                options->output_filename = NULL;
+            }
+
+            return true;
+        }
+
+        journal_begin( options->journal, input_hash, options->options_hash );
+    }
+
+    if ( NULL == ( image_file = zfopen( input_filename ) ) )
+    {
+        perror( "Error opening image file" );
+        return false;
+    }
+
+    if ( xcf_probe( input_filename ) )
+    {
+        image_size = read_xcf( image_file, color_palette, ncolors, raw_image, &x_size, &y_size );
+    }
+    else
+    {
+        if ( !get_image_dimensions( image_file, read_buffer, sizeof( read_buffer), &x_size, &y_size, &rgb ) )
+        {
+            fputs( "Can't get image dimensions\n", stderr );
+            fclose( image_file );
+            return false;
+        }
+
+        if ( !check_dimensions( x_size, y_size ) )
+        {
+            fclose( image_file );
+            return false;
+        }
+
+        if ( !rgb && ncolors != translate_cmap( image_file, read_buffer, sizeof( read_buffer ), color_palette, color_translation, ncolors ) )
+        {
+            fputs( "Error: Palette does not match\n", stderr );
+            fclose( image_file );
+            return false;
+        }
+
+        if ( !search_for_header_data( image_file, read_buffer, sizeof( read_buffer ), rgb ) )
+        {
+            fputs( "Can't find image data\n", stderr );
+            fclose( image_file );
+            return false;
+        }
+
+        if ( rgb )
+        {
+            image_size = parse_rgb_image( image_file, read_buffer, sizeof( read_buffer ), luma_image );
+        }
+        else
+        {
+            options->kernels[KERNEL_PARSE] = kernel_select( KERNEL_PARSE, x_size, (int)log2( ncolors ) );
+            image_size = parse_image( image_file, raw_image, color_translation, options->kernels[KERNEL_PARSE] );
+            tokenized = true;
+        }
+    }
+
+    fclose( image_file );
+
+    if ( 0 == image_size )
+    {
+        return false;
+    }
     
-    if ( ! get_options( argc, argv, &options ) )
+    printf( "Image size: %d pixels\n", image_size );
+
+    if ( image_size != x_size * y_size )
     {
-        usage( argv[0] );
-        exit( EXIT_FAILURE );
+        fprintf( stderr, "Error: Expected image size is %d (Bad image file?)\n", x_size * y_size );
+        return false;
     }
 
-    if ( NULL == options.output_filename )
+    color_bits = (int)log2( ncolors );
+
+    printf( "Color bits: %d\n", color_bits );
+
+    options->kernels[KERNEL_PACK] = kernel_select( KERNEL_PACK, x_size, color_bits );
+    options->kernels[KERNEL_HEX] = kernel_select( KERNEL_HEX, x_size, color_bits );
+
+    if ( options->npayloads && ! place_payloads( options, map_filename, color_bits, x_size, y_size ) )
     {
-        options.output_filename = malloc( strlen( options.input_filename ) + strlen( options.format->format_string ) + 2 );
-        if ( NULL == options.output_filename )
+        return false;
+    }
+
+    if ( rgb && options->budget )
+    {
+        if ( ! rd_dither( options, levels, palette_luma, luma_image, raw_image, x_size, y_size, color_bits, &history ) )
         {
-            perror( "Error: Can't allocate output filename" );
-            exit( EXIT_FAILURE );
+            return false;
         }
+    }
+    else if ( rgb )
+    {
+        dither_params_t params = { 100, 0, options->temporal_threshold };
+        int kept = dither_image( levels, luma_image, raw_image, x_size, y_size, &history, &params );
 
-        strcpy( options.output_filename, options.input_filename );
-        char *dot = strrchr ( options.output_filename, '.' );
-        if ( dot == NULL )
+        if ( options->temporal_threshold )
         {
-            strcat( options.output_filename, "." );
+            printf( "Dithering: kept %d pixels from previous frame\n", kept );
+        }
+    }
+
+    data_size = convert_to_layers( raw_image, converted_image, color_bits, x_size, y_size, options->kernels[KERNEL_PACK] );
+
+    if ( options->temporal_threshold )
+    {
+        if ( data_size == previous_data_size )
+        {
+            int changed = 0;
+
+            for ( int cbit = 0; cbit < color_bits; ++cbit )
+            {
+                for ( int bytenum = 0; bytenum < data_size / color_bits; ++bytenum )
+                {
+                    changed += converted_image[cbit * CARD_MEMORY_SIZE + bytenum] != previous_image[cbit * CARD_MEMORY_SIZE + bytenum];
+                }
+            }
+
+            printf( "Changed bytes from previous frame: %d\n", changed );
+        }
+
+        memcpy( previous_image, converted_image, sizeof( converted_image ) );
+        previous_data_size = data_size;
+    }
+    
+    if ( options->simulate && ! simulate_copy( converted_image, options, data_size, color_bits, x_size, y_size ) )
+    {
+        return false;
+    }
+
+    char *output_buffer = NULL;
+    size_t output_size = 0;
+    FILE *output_file = open_memstream( &output_buffer, &output_size );
+
+    if ( NULL == output_file )
+    {
+        perror( "Error: Can't allocate output buffer" );
+        return false;
+    }
+
+    bool result = options->format->output_fn( output_file, converted_image, options, data_size, color_bits, x_size, y_size );
+
+    fclose( output_file );
+
+    if ( options->stats )
+    {
+        printf( "Kernels: parse=%s pack=%s hex=%s\n",
+                tokenized ? kernel_variant_names[KERNEL_PARSE][options->kernels[KERNEL_PARSE]] : "-",
+                kernel_variant_names[KERNEL_PACK][options->kernels[KERNEL_PACK]],
+                options->format->records ? kernel_variant_names[KERNEL_HEX][options->kernels[KERNEL_HEX]] : "-" );
+    }
+
+    if ( result && options->budget && output_size > options->budget )
+    {
+        fprintf( stderr, "Warning: Output size is %zu bytes, over the budget of %zu\n", output_size, options->budget );
+    }
+
+    result = result && update_file( options->output_filename, output_buffer, output_size, options->journal );
+
+    if ( result && options->nports )
+    {
+        send_options_t send_options = { options->baud_rate, options->char_delay, options->verify_echo };
+
+        result = send_records( options->port_names, options->nports, output_buffer, output_size, &send_options );
+    }
+
+    if ( result && NULL != options->journal )
+    {
+        result = journal_commit( options->journal );
+    }
+
+    free( output_buffer );
+
+    if ( result && NULL != dep_file )
+    {
+        add_dep_rule( options, input_filename, map_filename, dep_file );
+    }
+
+    free( map_filename );
+
+    if ( result && NULL != slide )
+    {
+        slide->input_filename = input_filename;
+        slide->output_filename = strdup( options->output_filename );
+        slide->image = malloc( color_bits * CARD_MEMORY_SIZE );
+        slide->data_size = data_size;
+        slide->color_bits = color_bits;
+        slide->x_size = x_size;
+        slide->y_size = y_size;
+
+        if ( NULL == slide->output_filename || NULL == slide->image )
+        {
+            perror( "Error: Can't allocate slide" );
+            result = false;
         }
         else
         {
-            *++dot = '\0';
+            memcpy( slide->image, converted_image, color_bits * CARD_MEMORY_SIZE );
+        }
+    }
+
+    if ( derived_filename )
+    {
+        free( options->output_filename );
+        options->output_filename = NULL;
+    }
+
+    return result;
+}
+
+// Orders the converted images of a slideshow to minimize the changed bytes
+// between consecutive ones and writes the delta from the previous image for
+// every one of them. The order file lists the full and delta output files in
+// playback order.
+bool write_slideshow( options_t *options, slide_t *slides, int nslides, FILE *dep_file )
+{
+    uint8_t **images = calloc( nslides, sizeof( uint8_t * ) );
+    int *tour = calloc( nslides, sizeof( int ) );
+    char **targets = calloc( nslides + 1, sizeof( char * ) );
+    char **prereqs = calloc( nslides + 1 + options->npayloads, sizeof( char * ) );
+    uint32_t *costs = NULL;
+    char *order_buffer = NULL;
+    size_t order_size = 0;
+    FILE *order_file = NULL;
+    bool result = false;
+
+    if ( NULL == images || NULL == tour || NULL == targets || NULL == prereqs )
+    {
+        perror( "Error: Can't allocate slideshow" );
+        goto out;
+    }
+
+    for ( int i = 0; i < nslides; ++i )
+    {
+        if (    slides[i].x_size != slides[0].x_size || slides[i].y_size != slides[0].y_size
+             || slides[i].color_bits != slides[0].color_bits )
+        {
+            fprintf( stderr, "Error: '%s' does not have the size of '%s'\n", slides[i].input_filename, slides[0].input_filename );
+            goto out;
+        }
+        images[i] = slides[i].image;
+        prereqs[i] = slides[i].input_filename;
+    }
+
+    slideshow_t show = { images, nslides, slides[0].color_bits, slides[0].data_size / slides[0].color_bits, CARD_MEMORY_SIZE };
+
+    if ( NULL == ( costs = slideshow_costs( &show ) ) )
+    {
+        goto out;
+    }
+
+    for ( int i = 0; i < nslides; ++i )
+    {
+        tour[i] = i;
+    }
+    uint64_t input_cost = slideshow_tour_cost( costs, nslides, tour );
+    uint64_t cost = slideshow_order( costs, nslides, tour );
+
+    printf( "Slideshow changed bytes: %" PRIu64 " (%" PRIu64 " in input order)\n", cost, input_cost );
+
+    if ( NULL == ( order_file = open_memstream( &order_buffer, &order_size ) ) )
+    {
+        perror( "Error: Can't allocate order file" );
+        goto out;
+    }
+
+    targets[0] = options->order_filename;
+
+    for ( int i = 0; i < nslides; ++i )
+    {
+        slide_t *slide = &slides[tour[i]];
+        char extension[16];
+        char *delta_buffer = NULL;
+        size_t delta_size = 0;
+        FILE *delta_file;
+
+        // The show loops, so the first image is a delta from the last one
+        options->reference = slides[tour[( i + nslides - 1 ) % nslides]].image;
+
+        snprintf( extension, sizeof( extension ), "delta.%s", options->format->format_string );
+
+        if ( NULL == ( targets[i + 1] = make_output_filename( slide->input_filename, extension ) ) )
+        {
+            goto out;
+        }
+
+        if ( NULL == ( delta_file = open_memstream( &delta_buffer, &delta_size ) ) )
+        {
+            perror( "Error: Can't allocate output buffer" );
+            goto out;
+        }
+
+        bool written = options->format->output_fn( delta_file, slide->image, options, slide->data_size, slide->color_bits, slide->x_size, slide->y_size );
+
+        fclose( delta_file );
+
+        printf( "%d: '%s', delta %u bytes in '%s'\n", i + 1, slide->output_filename, costs[tour[i] * nslides + tour[( i + nslides - 1 ) % nslides]], targets[i + 1] );
+
+        written = written && update_file( targets[i + 1], delta_buffer, delta_size, options->journal );
+
+        free( delta_buffer );
+
+        if ( ! written )
+        {
+            goto out;
+        }
+
+        fprintf( order_file, "%s %s\n", slide->output_filename, targets[i + 1] );
+    }
+
+    fclose( order_file );
+    order_file = NULL;
+
+    if ( ! update_file( options->order_filename, order_buffer, order_size, options->journal ) )
+    {
+        goto out;
+    }
+
+    if ( NULL != dep_file )
+    {
+        int nprereqs = nslides;
+
+        if ( NULL != options->palette_filename )
+        {
+            prereqs[nprereqs++] = options->palette_filename;
+        }
+        for ( int p = 0; p < options->npayloads; ++p )
+        {
+            prereqs[nprereqs++] = options->payloads[p].file_name;
+        }
+
+        // The order depends on every image
+        write_dep_rule( dep_file, targets, nslides + 1, prereqs, nprereqs );
+    }
+
+    result = true;
+
+out:
+    options->reference = NULL;
+
+    if ( NULL != order_file )
+    {
+        fclose( order_file );
+    }
+    for ( int i = 1; targets && i <= nslides; ++i )
+    {
+        free( targets[i] );
+    }
+    free( order_buffer );
+    free( costs );
+    free( prereqs );
+    free( targets );
+    free( tour );
+    free( images );
+
+    return result;
+}
+
+#define TUNE_RUNS 5
+
+typedef struct {
+    options_t *options;
+    char *text;                 // Header data of the synthetic image
+    size_t text_size;
+    uint8_t *raw;
+    uint16_t x_size;
+    int color_bits;
+    uint8_t *converted;
+    int data_size;
+} tune_ctx_t;
+
+// Runs a stage with a kernel variant. Returns its output, to be checked
+// against the other variants.
+static bool tune_run( tune_ctx_t *ctx, kernel_stage_t stage, int kernel, char **result, size_t *result_size )
+{
+    static uint8_t image[MAX_IMAGE_SIZE];
+    static uint8_t converted[MAX_CARDS*CARD_MEMORY_SIZE];
+    uint8_t cmap[256];
+    FILE *file;
+
+    *result = NULL;
+    *result_size = 0;
+
+    switch ( stage )
+    {
+        case KERNEL_PARSE:
+            for ( int c = 0; c < 256; ++c )
+            {
+                cmap[c] = c;
+            }
+            if ( NULL == ( file = fmemopen( ctx->text, ctx->text_size, "r" ) ) )
+            {
+                perror( "Error: Can't open synthetic image" );
+                return false;
+            }
+            *result_size = parse_image( file, image, cmap, kernel );
+            *result = (char *) image;
+            fclose( file );
+            return 0 != *result_size;
+
+        case KERNEL_PACK:
+            *result_size = convert_to_layers( ctx->raw, converted, ctx->color_bits, ctx->x_size, MAX_ROWS, kernel );
+            *result = (char *) converted;
+            // Only the used part of every plane
+            for ( int cbit = 1; cbit < ctx->color_bits; ++cbit )
+            {
+                memmove( converted + cbit * *result_size / ctx->color_bits, converted + cbit * CARD_MEMORY_SIZE, *result_size / ctx->color_bits );
+            }
+            return true;
+
+        default:
+            if ( NULL == ( file = open_memstream( result, result_size ) ) )
+            {
+                perror( "Error: Can't allocate output buffer" );
+                return false;
+            }
+            ctx->options->kernels[KERNEL_HEX] = kernel;
+            bool written =    output_pap( file, ctx->converted, ctx->options, ctx->data_size, ctx->color_bits, ctx->x_size, MAX_ROWS )
+                           && output_ihex( file, ctx->converted, ctx->options, ctx->data_size, ctx->color_bits, ctx->x_size, MAX_ROWS );
+            fclose( file );
+            return written;
+    }
+}
+
+// Times every variant of a stage, checking that they agree. Returns the winner.
+static int tune_stage( tune_ctx_t *ctx, kernel_stage_t stage )
+{
+    char *reference = NULL, *result;
+    size_t reference_size = 0, result_size;
+    double best_time = 0;
+    int winner = -1;
+
+    printf( "%-5s %3u pixels, %d bits:", kernel_stage_names[stage], ctx->x_size, ctx->color_bits );
+
+    for ( int kernel = 0; kernel < KERNEL_VARIANTS; ++kernel )
+    {
+        double kernel_best = 0;
+
+        for ( int run = 0; run < TUNE_RUNS; ++run )
+        {
+            double start = kernel_time();
+            bool ok = tune_run( ctx, stage, kernel, &result, &result_size );
+            double elapsed = kernel_time() - start;
+
+            if ( ok && 0 == kernel && 0 == run )
+            {
+                // Static buffers are reused, so keep a copy
+                if ( NULL != ( reference = malloc( result_size ) ) )
+                {
+                    memcpy( reference, result, result_size );
+                    reference_size = result_size;
+                }
+            }
+            ok = ok && NULL != reference && result_size == reference_size && !memcmp( result, reference, result_size );
+
+            if ( stage == KERNEL_HEX )
+            {
+                free( result );
+            }
+
+            if ( ! ok )
+            {
+                fprintf( stderr, "\nError: %s kernel %s gives wrong results\n", kernel_stage_names[stage], kernel_variant_names[stage][kernel] );
+                free( reference );
+                return -1;
+            }
+
+            if ( 0 == run || elapsed < kernel_best )
+            {
+                kernel_best = elapsed;
+            }
         }
-        strcat( options.output_filename, options.format->format_string );
 
-        printf( "Output file is '%s'\n", options.output_filename );
+        printf( " %s %.3f ms", kernel_variant_names[stage][kernel], kernel_best * 1000 );
+
+        if ( winner < 0 || kernel_best < best_time )
+        {
+            winner = kernel;
+            best_time = kernel_best;
+        }
+    }
+
+    printf( " -> %s\n", kernel_variant_names[stage][winner] );
+
+    free( reference );
+
+    return winner;
+}
+
+// Benchmarks the kernel variants on synthetic images of every width class and
+// color depth and writes the winners to the profile, replacing the lines of
+// this CPU and keeping those of others
+bool tune_kernels( options_t *options )
+{
+    static uint8_t raw[MAX_IMAGE_SIZE];
+    static uint8_t converted[MAX_CARDS*CARD_MEMORY_SIZE];
+    const char *model = kernel_cpu_model();
+    kernel_profile_t profile;
+    char *profile_buffer = NULL, *line = NULL;
+    size_t profile_size = 0, line_size = 0;
+    FILE *file;
+    bool result = true;
+
+    printf( "Tuning kernels for %s\n", model );
+
+    srand( 1 );
+
+    for ( int w = 0; result && w < KERNEL_WIDTHS; ++w )
+    {
+        for ( int color_bits = 1; result && color_bits <= KERNEL_MAX_BITS; ++color_bits )
+        {
+            tune_ctx_t ctx = { options, NULL, 0, raw, kernel_widths[w], color_bits, converted, 0 };
+            int npixels = kernel_widths[w] * MAX_ROWS;
+
+            if ( NULL == ( file = open_memstream( &ctx.text, &ctx.text_size ) ) )
+            {
+                perror( "Error: Can't allocate synthetic image" );
+                return false;
+            }
+
+            // Same layout as GIMP's header_data array
+            for ( int pixel = 0; pixel < npixels; ++pixel )
+            {
+                raw[pixel] = rand() & ( ( 1 << color_bits ) - 1 );
+                fprintf( file, pixel % 16 ? "%u," : "\n\t%u,", raw[pixel] );
+            }
+            fputs( "\n\t};\n", file );
+            fclose( file );
+
+            ctx.data_size = convert_to_layers( raw, converted, color_bits, ctx.x_size, MAX_ROWS, 0 );
+
+            for ( int stage = 0; result && stage < KERNEL_STAGES; ++stage )
+            {
+                int winner = tune_stage( &ctx, stage );
+
+                profile[stage][w][color_bits - 1] = winner;
+                result = winner >= 0;
+            }
+
+            free( ctx.text );
+        }
+    }
+
+    if ( ! result )
+    {
+        return false;
+    }
+
+    if ( NULL == ( file = open_memstream( &profile_buffer, &profile_size ) ) )
+    {
+        perror( "Error: Can't allocate profile" );
+        return false;
+    }
+
+    FILE *old_profile = fopen( kernel_profile_filename(), "r" );
+
+    if ( NULL != old_profile )
+    {
+        size_t model_length = strlen( model );
+        ssize_t length;
+
+        while ( 0 < ( length = getline( &line, &line_size, old_profile ) ) )
+        {
+            line[strcspn( line, "\n" )] = '\0';
+            length = strlen( line );
+
+            if (    length <= (ssize_t) model_length || line[length - model_length - 1] != ' '
+                 || strcmp( line + length - model_length, model ) )
+            {
+                fprintf( file, "%s\n", line );
+            }
+        }
+        free( line );
+        fclose( old_profile );
+    }
+
+    result = kernel_write_profile( file, profile );
+
+    fclose( file );
+
+    result = result && update_file( kernel_profile_filename(), profile_buffer, profile_size, NULL );
+
+    if ( result )
+    {
+        printf( "Profile written to '%s'\n", kernel_profile_filename() );
+    }
+
+    free( profile_buffer );
+
+    return result;
+}
+
+// Hashes the options that change the output of a job, and the palette
+bool hash_options( options_t *options )
+{
+    uint64_t hash = JOURNAL_HASH_INIT;
+    size_t palette_size = 0;
+
+    hash = journal_hash( options->format->format_string, strlen( options->format->format_string ), hash );
+    hash = journal_hash( &options->base_address, sizeof( options->base_address ), hash );
+    hash = journal_hash( &options->sparse, sizeof( options->sparse ), hash );
+    hash = journal_hash( &options->budget, sizeof( options->budget ), hash );
+
+    // Symbols come from the file names and end up in the output and map files.
+    // The NULs and sizes keep the fields of consecutive payloads apart.
+    for ( int p = 0; p < options->npayloads; ++p )
+    {
+        pack_payload_t *payload = &options->payloads[p];
+
+        hash = journal_hash( payload->symbol, strlen( payload->symbol ) + 1, hash );
+        hash = journal_hash( &payload->size, sizeof( payload->size ), hash );
+        hash = journal_hash( payload->data, payload->size, hash );
+    }
+
+    if ( NULL != options->palette_filename )
+    {
+        uint64_t palette_hash;
+
+        if ( ! journal_hash_file( options->palette_filename, &palette_hash, &palette_size ) )
+        {
+            perror( "Error opening palette file" );
+            return false;
+        }
+        hash = journal_hash( &palette_hash, sizeof( palette_hash ), hash );
+    }
+
+    options->options_hash = hash;
+
+    return true;
+}
+
+int main( int argc, char **argv )
+{
+    char read_buffer[BUFSIZ];
+    color_t color_palette[MAX_PALETTE_SIZE] = { { 0, 0, 0}, {255, 255, 255} };
+    uint8_t palette_luma[MAX_PALETTE_SIZE];
+    dither_levels_t levels;
+
+    options_t options;
+
+    int ncolors = 2;
+
+    char *dep_buffer = NULL;
+    size_t dep_size = 0;
+    FILE *dep_file = NULL;
+
+    slide_t *slides = NULL;
+
+    journal_t journal;
+    
+    if ( ! get_options( argc, argv, &options ) )
+    {
+        usage( argv[0] );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( options.tune )
+    {
+        exit( tune_kernels( &options ) ? EXIT_SUCCESS : EXIT_FAILURE );
+    }
+
+    bool profiled = kernel_load_profile();
+
+    if ( options.stats )
+    {
+        printf( "Kernel profile: %s\n", profiled ? kernel_profile_filename() : "none, using defaults" );
     }
 
     if ( NULL != options.palette_filename )
@@ -574,59 +2541,84 @@ int main( int argc, char **argv )
     {
         puts( "Using default 1-bit black & white palette." );
     }
-    
-    if ( NULL == ( image_file = fopen( options.input_filename, "r" ) ) )
+
+    for ( int c = 0; c < ncolors; ++c )
     {
-        perror( "Error opening image file" );
-        exit( EXIT_FAILURE );
+        palette_luma[c] = dither_luma( color_palette[c].r, color_palette[c].g, color_palette[c].b );
     }
+    dither_levels( &levels, palette_luma, ncolors );
 
-    if ( !get_image_dimensions( image_file, read_buffer, sizeof( read_buffer), &x_size, &y_size ) )
+    if ( options.npayloads && NULL == ( options.payloads = calloc( options.npayloads, sizeof( pack_payload_t ) ) ) )
     {
-        fputs( "Can't get image dimensions\n", stderr );
+        perror( "Error: Can't allocate payloads" );
         exit( EXIT_FAILURE );
     }
 
-    printf( "Image dimensions: %ux%u pixels\n", x_size, y_size );
+    for ( int p = 0; p < options.npayloads; ++p )
+    {
+        if ( ! pack_read_payload( &options.payloads[p], options.payload_filenames[p] ) )
+        {
+            exit( EXIT_FAILURE );
+        }
 
-    if ( x_size > MAX_COL_BYTES * 8 || y_size > MAX_ROWS )
+        for ( int q = 0; q < p; ++q )
+        {
+            if ( !strcmp( options.payloads[p].symbol, options.payloads[q].symbol ) )
+            {
+                fprintf( stderr, "Error: Payloads '%s' and '%s' have the same symbol\n", options.payload_filenames[q], options.payload_filenames[p] );
+                exit( EXIT_FAILURE );
+            }
+        }
+    }
+
+    if ( NULL != options.journal_filename )
     {
-        fprintf( stderr, "Error: Max. image size is %ux%u\n", MAX_COL_BYTES * 8, MAX_ROWS );
-        exit( EXIT_FAILURE );
+        if ( ! hash_options( &options ) || ! journal_open( &journal, options.journal_filename ) )
+        {
+            exit( EXIT_FAILURE );
+        }
+        options.journal = &journal;
     }
 
-    if ( ncolors != translate_cmap( image_file, read_buffer, sizeof( read_buffer ), color_palette, color_translation, ncolors ) )
+    if ( NULL != options.dep_filename && NULL == ( dep_file = open_memstream( &dep_buffer, &dep_size ) ) )
     {
-        fputs( "Error: Palette does not match\n", stderr );
+        perror( "Error: Can't create dependency file" );
         exit( EXIT_FAILURE );
     }
 
-    if ( !search_for_header_data( image_file, read_buffer, sizeof( read_buffer ) ) )
+    if ( NULL != options.order_filename && NULL == ( slides = calloc( options.ninputs, sizeof( slide_t ) ) ) )
     {
-        fputs( "Can't find image data\n", stderr );
+        perror( "Error: Can't allocate slideshow" );
         exit( EXIT_FAILURE );
     }
 
-    if ( 0 == ( image_size = parse_image( image_file, read_buffer, sizeof( read_buffer ), raw_image, color_translation ) ) )
+    for ( int i = 0; i < options.ninputs; ++i )
     {
-        exit( EXIT_FAILURE );
+        if ( ! convert_file( &options, options.input_filenames[i], color_palette, ncolors, palette_luma, &levels, dep_file, slides ? &slides[i] : NULL ) )
+        {
+            exit( EXIT_FAILURE );
+        }
     }
 
-    fclose( image_file );
-    
-    printf( "Image size: %d pixels\n", image_size );
+    if ( NULL != slides && ! write_slideshow( &options, slides, options.ninputs, dep_file ) )
+    {
+        exit( EXIT_FAILURE );
+    }
 
-    if ( image_size != x_size * y_size )
+    if ( NULL != options.journal && ! journal_close( options.journal ) )
     {
-        fprintf( stderr, "Error: Expected image size is %d (Bad image file?)\n", x_size * y_size );
         exit( EXIT_FAILURE );
     }
 
-    color_bits = (int)log2( ncolors );
+    if ( NULL != dep_file )
+    {
+        fclose( dep_file );
 
-    data_size = convert_to_layers( raw_image, converted_image, color_bits, x_size, y_size );
-    
-    options.format->output_fn( converted_image, &options, data_size, color_bits, x_size, y_size );
+        if ( ! update_file( options.dep_filename, dep_buffer, dep_size, NULL ) )
+        {
+            exit( EXIT_FAILURE );
+        }
+    }
 
     exit( EXIT_SUCCESS );
 
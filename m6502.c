@@ -0,0 +1,516 @@
+// Cycle counting 6502 simulator.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// NMOS 6502 core with the documented opcodes only, running on a flat 64 KB
+// memory with no I/O or ROM. Cycle counts include the page crossing and taken
+// branch penalties, and decimal mode follows the NMOS flag behaviour.
+//
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "m6502.h"
+
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_D 0x08
+#define FLAG_B 0x10
+#define FLAG_U 0x20
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+
+#define RETURN_ADDRESS 0xFFFF
+
+typedef enum {
+    ILL, ADC, AND, ASL, BCC, BCS, BEQ, BIT, BMI, BNE, BPL, BRK, BVC, BVS, CLC,
+    CLD, CLI, CLV, CMP, CPX, CPY, DEC, DEX, DEY, EOR, INC, INX, INY, JMP, JSR,
+    LDA, LDX, LDY, LSR, NOP, ORA, PHA, PHP, PLA, PLP, ROL, ROR, RTI, RTS, SBC,
+    SEC, SED, SEI, STA, STX, STY, TAX, TAY, TSX, TXA, TXS, TYA
+} instr_t;
+
+typedef enum { IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABX, ABY, IND, IZX, IZY, REL } addr_mode_t;
+
+typedef struct {
+    uint8_t instr;
+    uint8_t mode;
+    uint8_t cycles;
+    uint8_t page_penalty;
+} opcode_t;
+
+static const opcode_t opcodes[256] = {
+    [0x69] = { ADC, IMM, 2 }, [0x65] = { ADC, ZP, 3 }, [0x75] = { ADC, ZPX, 4 }, [0x6D] = { ADC, ABS, 4 },
+    [0x7D] = { ADC, ABX, 4, 1 }, [0x79] = { ADC, ABY, 4, 1 }, [0x61] = { ADC, IZX, 6 }, [0x71] = { ADC, IZY, 5, 1 },
+
+    [0x29] = { AND, IMM, 2 }, [0x25] = { AND, ZP, 3 }, [0x35] = { AND, ZPX, 4 }, [0x2D] = { AND, ABS, 4 },
+    [0x3D] = { AND, ABX, 4, 1 }, [0x39] = { AND, ABY, 4, 1 }, [0x21] = { AND, IZX, 6 }, [0x31] = { AND, IZY, 5, 1 },
+
+    [0x0A] = { ASL, ACC, 2 }, [0x06] = { ASL, ZP, 5 }, [0x16] = { ASL, ZPX, 6 }, [0x0E] = { ASL, ABS, 6 },
+    [0x1E] = { ASL, ABX, 7 },
+
+    [0x90] = { BCC, REL, 2 }, [0xB0] = { BCS, REL, 2 }, [0xF0] = { BEQ, REL, 2 }, [0x30] = { BMI, REL, 2 },
+    [0xD0] = { BNE, REL, 2 }, [0x10] = { BPL, REL, 2 }, [0x50] = { BVC, REL, 2 }, [0x70] = { BVS, REL, 2 },
+
+    [0x24] = { BIT, ZP, 3 }, [0x2C] = { BIT, ABS, 4 },
+
+    [0x00] = { BRK, IMP, 7 },
+
+    [0x18] = { CLC, IMP, 2 }, [0xD8] = { CLD, IMP, 2 }, [0x58] = { CLI, IMP, 2 }, [0xB8] = { CLV, IMP, 2 },
+
+    [0xC9] = { CMP, IMM, 2 }, [0xC5] = { CMP, ZP, 3 }, [0xD5] = { CMP, ZPX, 4 }, [0xCD] = { CMP, ABS, 4 },
+    [0xDD] = { CMP, ABX, 4, 1 }, [0xD9] = { CMP, ABY, 4, 1 }, [0xC1] = { CMP, IZX, 6 }, [0xD1] = { CMP, IZY, 5, 1 },
+
+    [0xE0] = { CPX, IMM, 2 }, [0xE4] = { CPX, ZP, 3 }, [0xEC] = { CPX, ABS, 4 },
+    [0xC0] = { CPY, IMM, 2 }, [0xC4] = { CPY, ZP, 3 }, [0xCC] = { CPY, ABS, 4 },
+
+    [0xC6] = { DEC, ZP, 5 }, [0xD6] = { DEC, ZPX, 6 }, [0xCE] = { DEC, ABS, 6 }, [0xDE] = { DEC, ABX, 7 },
+    [0xCA] = { DEX, IMP, 2 }, [0x88] = { DEY, IMP, 2 },
+
+    [0x49] = { EOR, IMM, 2 }, [0x45] = { EOR, ZP, 3 }, [0x55] = { EOR, ZPX, 4 }, [0x4D] = { EOR, ABS, 4 },
+    [0x5D] = { EOR, ABX, 4, 1 }, [0x59] = { EOR, ABY, 4, 1 }, [0x41] = { EOR, IZX, 6 }, [0x51] = { EOR, IZY, 5, 1 },
+
+    [0xE6] = { INC, ZP, 5 }, [0xF6] = { INC, ZPX, 6 }, [0xEE] = { INC, ABS, 6 }, [0xFE] = { INC, ABX, 7 },
+    [0xE8] = { INX, IMP, 2 }, [0xC8] = { INY, IMP, 2 },
+
+    [0x4C] = { JMP, ABS, 3 }, [0x6C] = { JMP, IND, 5 }, [0x20] = { JSR, ABS, 6 },
+
+    [0xA9] = { LDA, IMM, 2 }, [0xA5] = { LDA, ZP, 3 }, [0xB5] = { LDA, ZPX, 4 }, [0xAD] = { LDA, ABS, 4 },
+    [0xBD] = { LDA, ABX, 4, 1 }, [0xB9] = { LDA, ABY, 4, 1 }, [0xA1] = { LDA, IZX, 6 }, [0xB1] = { LDA, IZY, 5, 1 },
+
+    [0xA2] = { LDX, IMM, 2 }, [0xA6] = { LDX, ZP, 3 }, [0xB6] = { LDX, ZPY, 4 }, [0xAE] = { LDX, ABS, 4 },
+    [0xBE] = { LDX, ABY, 4, 1 },
+
+    [0xA0] = { LDY, IMM, 2 }, [0xA4] = { LDY, ZP, 3 }, [0xB4] = { LDY, ZPX, 4 }, [0xAC] = { LDY, ABS, 4 },
+    [0xBC] = { LDY, ABX, 4, 1 },
+
+    [0x4A] = { LSR, ACC, 2 }, [0x46] = { LSR, ZP, 5 }, [0x56] = { LSR, ZPX, 6 }, [0x4E] = { LSR, ABS, 6 },
+    [0x5E] = { LSR, ABX, 7 },
+
+    [0xEA] = { NOP, IMP, 2 },
+
+    [0x09] = { ORA, IMM, 2 }, [0x05] = { ORA, ZP, 3 }, [0x15] = { ORA, ZPX, 4 }, [0x0D] = { ORA, ABS, 4 },
+    [0x1D] = { ORA, ABX, 4, 1 }, [0x19] = { ORA, ABY, 4, 1 }, [0x01] = { ORA, IZX, 6 }, [0x11] = { ORA, IZY, 5, 1 },
+
+    [0x48] = { PHA, IMP, 3 }, [0x08] = { PHP, IMP, 3 }, [0x68] = { PLA, IMP, 4 }, [0x28] = { PLP, IMP, 4 },
+
+    [0x2A] = { ROL, ACC, 2 }, [0x26] = { ROL, ZP, 5 }, [0x36] = { ROL, ZPX, 6 }, [0x2E] = { ROL, ABS, 6 },
+    [0x3E] = { ROL, ABX, 7 },
+
+    [0x6A] = { ROR, ACC, 2 }, [0x66] = { ROR, ZP, 5 }, [0x76] = { ROR, ZPX, 6 }, [0x6E] = { ROR, ABS, 6 },
+    [0x7E] = { ROR, ABX, 7 },
+
+    [0x40] = { RTI, IMP, 6 }, [0x60] = { RTS, IMP, 6 },
+
+    [0xE9] = { SBC, IMM, 2 }, [0xE5] = { SBC, ZP, 3 }, [0xF5] = { SBC, ZPX, 4 }, [0xED] = { SBC, ABS, 4 },
+    [0xFD] = { SBC, ABX, 4, 1 }, [0xF9] = { SBC, ABY, 4, 1 }, [0xE1] = { SBC, IZX, 6 }, [0xF1] = { SBC, IZY, 5, 1 },
+
+    [0x38] = { SEC, IMP, 2 }, [0xF8] = { SED, IMP, 2 }, [0x78] = { SEI, IMP, 2 },
+
+    [0x85] = { STA, ZP, 3 }, [0x95] = { STA, ZPX, 4 }, [0x8D] = { STA, ABS, 4 }, [0x9D] = { STA, ABX, 5 },
+    [0x99] = { STA, ABY, 5 }, [0x81] = { STA, IZX, 6 }, [0x91] = { STA, IZY, 6 },
+
+    [0x86] = { STX, ZP, 3 }, [0x96] = { STX, ZPY, 4 }, [0x8E] = { STX, ABS, 4 },
+    [0x84] = { STY, ZP, 3 }, [0x94] = { STY, ZPX, 4 }, [0x8C] = { STY, ABS, 4 },
+
+    [0xAA] = { TAX, IMP, 2 }, [0xA8] = { TAY, IMP, 2 }, [0xBA] = { TSX, IMP, 2 }, [0x8A] = { TXA, IMP, 2 },
+    [0x9A] = { TXS, IMP, 2 }, [0x98] = { TYA, IMP, 2 }
+};
+
+static inline uint8_t read8( m6502_t *cpu, uint16_t address )
+{
+    return cpu->memory[address];
+}
+
+static inline uint16_t read16( m6502_t *cpu, uint16_t address )
+{
+    return read8( cpu, address ) | read8( cpu, address + 1 ) << 8;
+}
+
+// Pointer read that wraps within the page, as zero page indirection and the
+// NMOS JMP ($xxFF) bug do
+static inline uint16_t read16_wrap( m6502_t *cpu, uint16_t address )
+{
+    return read8( cpu, address ) | read8( cpu, ( address & 0xFF00 ) | ( ( address + 1 ) & 0x00FF ) ) << 8;
+}
+
+static inline void write8( m6502_t *cpu, uint16_t address, uint8_t value )
+{
+    cpu->memory[address] = value;
+}
+
+static inline void push( m6502_t *cpu, uint8_t value )
+{
+    write8( cpu, 0x0100 | cpu->s--, value );
+}
+
+static inline uint8_t pull( m6502_t *cpu )
+{
+    return read8( cpu, 0x0100 | ++cpu->s );
+}
+
+static inline void set_nz( m6502_t *cpu, uint8_t value )
+{
+    cpu->p = ( cpu->p & ~( FLAG_N | FLAG_Z ) ) | ( value & FLAG_N ) | ( value ? 0 : FLAG_Z );
+}
+
+static inline void set_flag( m6502_t *cpu, uint8_t flag, bool value )
+{
+    cpu->p = value ? cpu->p | flag : cpu->p & ~flag;
+}
+
+static void compare( m6502_t *cpu, uint8_t reg, uint8_t value )
+{
+    set_flag( cpu, FLAG_C, reg >= value );
+    set_nz( cpu, reg - value );
+}
+
+static void adc( m6502_t *cpu, uint8_t value )
+{
+    unsigned carry = cpu->p & FLAG_C;
+    unsigned sum = cpu->a + value + carry;
+
+    if ( cpu->p & FLAG_D )
+    {
+        unsigned lo = ( cpu->a & 0x0F ) + ( value & 0x0F ) + carry;
+        unsigned hi;
+
+        if ( lo > 0x09 )
+        {
+            lo += 0x06;
+        }
+        hi = ( cpu->a >> 4 ) + ( value >> 4 ) + ( lo > 0x0F );
+
+        // Z from the binary sum, N and V from the intermediate result
+        set_flag( cpu, FLAG_Z, !( sum & 0xFF ) );
+        set_flag( cpu, FLAG_N, hi & 0x08 );
+        set_flag( cpu, FLAG_V, ~( cpu->a ^ value ) & ( cpu->a ^ ( hi << 4 ) ) & 0x80 );
+
+        if ( hi > 0x09 )
+        {
+            hi += 0x06;
+        }
+        set_flag( cpu, FLAG_C, hi > 0x0F );
+        cpu->a = ( hi << 4 ) | ( lo & 0x0F );
+    }
+    else
+    {
+        set_flag( cpu, FLAG_C, sum > 0xFF );
+        set_flag( cpu, FLAG_V, ~( cpu->a ^ value ) & ( cpu->a ^ sum ) & 0x80 );
+        cpu->a = sum;
+        set_nz( cpu, cpu->a );
+    }
+}
+
+static void sbc( m6502_t *cpu, uint8_t value )
+{
+    unsigned borrow = !( cpu->p & FLAG_C );
+    unsigned diff = cpu->a - value - borrow;
+
+    // Flags are always those of the binary subtraction
+    set_flag( cpu, FLAG_C, diff < 0x100 );
+    set_flag( cpu, FLAG_V, ( cpu->a ^ value ) & ( cpu->a ^ diff ) & 0x80 );
+    set_nz( cpu, diff );
+
+    if ( cpu->p & FLAG_D )
+    {
+        int lo = ( cpu->a & 0x0F ) - ( value & 0x0F ) - borrow;
+        int hi = ( cpu->a >> 4 ) - ( value >> 4 );
+
+        if ( lo < 0 )
+        {
+            lo -= 0x06;
+            --hi;
+        }
+        if ( hi < 0 )
+        {
+            hi -= 0x06;
+        }
+        cpu->a = ( (unsigned) hi << 4 ) | ( lo & 0x0F );
+    }
+    else
+    {
+        cpu->a = diff;
+    }
+}
+
+static uint8_t shift( m6502_t *cpu, uint8_t instr, uint8_t value )
+{
+    unsigned carry = cpu->p & FLAG_C;
+
+    switch ( instr )
+    {
+        case ASL:
+            set_flag( cpu, FLAG_C, value & 0x80 );
+            value <<= 1;
+            break;
+
+        case LSR:
+            set_flag( cpu, FLAG_C, value & 0x01 );
+            value >>= 1;
+            break;
+
+        case ROL:
+            set_flag( cpu, FLAG_C, value & 0x80 );
+            value = value << 1 | carry;
+            break;
+
+        case ROR:
+            set_flag( cpu, FLAG_C, value & 0x01 );
+            value = value >> 1 | carry << 7;
+            break;
+    }
+
+    set_nz( cpu, value );
+
+    return value;
+}
+
+void m6502_reset( m6502_t *cpu, uint8_t *memory )
+{
+    cpu->a = cpu->x = cpu->y = 0;
+    cpu->s = 0xFD;
+    cpu->p = FLAG_U | FLAG_I;
+    cpu->memory = memory;
+    cpu->pc = read16( cpu, 0xFFFC );
+    cpu->cycles = 0;
+}
+
+// Executes one instruction. Returns its cycle count or 0 for undocumented
+// opcodes, which are not executed.
+int m6502_step( m6502_t *cpu )
+{
+    const opcode_t *op = &opcodes[read8( cpu, cpu->pc )];
+    uint16_t address = 0, base;
+    int cycles = op->cycles;
+    bool taken = false;
+
+    if ( ILL == op->instr )
+    {
+        return 0;
+    }
+
+    ++cpu->pc;
+
+    switch ( op->mode )
+    {
+        case IMM:
+            address = cpu->pc++;
+            break;
+
+        case ZP:
+            address = read8( cpu, cpu->pc++ );
+            break;
+
+        case ZPX:
+            address = ( read8( cpu, cpu->pc++ ) + cpu->x ) & 0xFF;
+            break;
+
+        case ZPY:
+            address = ( read8( cpu, cpu->pc++ ) + cpu->y ) & 0xFF;
+            break;
+
+        case ABS:
+            address = read16( cpu, cpu->pc );
+            cpu->pc += 2;
+            break;
+
+        case ABX:
+        case ABY:
+            base = read16( cpu, cpu->pc );
+            cpu->pc += 2;
+            address = base + ( op->mode == ABX ? cpu->x : cpu->y );
+            cycles += op->page_penalty && ( base ^ address ) & 0xFF00;
+            break;
+
+        case IND:
+            address = read16_wrap( cpu, read16( cpu, cpu->pc ) );
+            cpu->pc += 2;
+            break;
+
+        case IZX:
+            address = read16_wrap( cpu, ( read8( cpu, cpu->pc++ ) + cpu->x ) & 0xFF );
+            break;
+
+        case IZY:
+            base = read16_wrap( cpu, read8( cpu, cpu->pc++ ) );
+            address = base + cpu->y;
+            cycles += op->page_penalty && ( base ^ address ) & 0xFF00;
+            break;
+
+        case REL:
+            address = cpu->pc + 1 + (int8_t) read8( cpu, cpu->pc );
+            ++cpu->pc;
+            break;
+
+        default:
+            break;
+    }
+
+    switch ( op->instr )
+    {
+        case ADC: adc( cpu, read8( cpu, address ) ); break;
+        case SBC: sbc( cpu, read8( cpu, address ) ); break;
+        case AND: cpu->a &= read8( cpu, address ); set_nz( cpu, cpu->a ); break;
+        case EOR: cpu->a ^= read8( cpu, address ); set_nz( cpu, cpu->a ); break;
+        case ORA: cpu->a |= read8( cpu, address ); set_nz( cpu, cpu->a ); break;
+
+        case ASL:
+        case LSR:
+        case ROL:
+        case ROR:
+            if ( ACC == op->mode )
+            {
+                cpu->a = shift( cpu, op->instr, cpu->a );
+            }
+            else
+            {
+                write8( cpu, address, shift( cpu, op->instr, read8( cpu, address ) ) );
+            }
+            break;
+
+        case BCC: taken = !( cpu->p & FLAG_C ); break;
+        case BCS: taken = cpu->p & FLAG_C; break;
+        case BNE: taken = !( cpu->p & FLAG_Z ); break;
+        case BEQ: taken = cpu->p & FLAG_Z; break;
+        case BPL: taken = !( cpu->p & FLAG_N ); break;
+        case BMI: taken = cpu->p & FLAG_N; break;
+        case BVC: taken = !( cpu->p & FLAG_V ); break;
+        case BVS: taken = cpu->p & FLAG_V; break;
+
+        case BIT:
+        {
+            uint8_t value = read8( cpu, address );
+
+            cpu->p = ( cpu->p & ~( FLAG_N | FLAG_V | FLAG_Z ) ) | ( value & ( FLAG_N | FLAG_V ) ) | ( cpu->a & value ? 0 : FLAG_Z );
+            break;
+        }
+
+        case BRK:
+            ++cpu->pc;                  // Signature byte
+            push( cpu, cpu->pc >> 8 );
+            push( cpu, cpu->pc & 0xFF );
+            push( cpu, cpu->p | FLAG_B | FLAG_U );
+            cpu->p |= FLAG_I;
+            cpu->pc = read16( cpu, 0xFFFE );
+            break;
+
+        case CLC: cpu->p &= ~FLAG_C; break;
+        case CLD: cpu->p &= ~FLAG_D; break;
+        case CLI: cpu->p &= ~FLAG_I; break;
+        case CLV: cpu->p &= ~FLAG_V; break;
+        case SEC: cpu->p |= FLAG_C; break;
+        case SED: cpu->p |= FLAG_D; break;
+        case SEI: cpu->p |= FLAG_I; break;
+
+        case CMP: compare( cpu, cpu->a, read8( cpu, address ) ); break;
+        case CPX: compare( cpu, cpu->x, read8( cpu, address ) ); break;
+        case CPY: compare( cpu, cpu->y, read8( cpu, address ) ); break;
+
+        case DEC:
+        {
+            uint8_t value = read8( cpu, address ) - 1;
+
+            write8( cpu, address, value );
+            set_nz( cpu, value );
+            break;
+        }
+
+        case INC:
+        {
+            uint8_t value = read8( cpu, address ) + 1;
+
+            write8( cpu, address, value );
+            set_nz( cpu, value );
+            break;
+        }
+
+        case DEX: set_nz( cpu, --cpu->x ); break;
+        case DEY: set_nz( cpu, --cpu->y ); break;
+        case INX: set_nz( cpu, ++cpu->x ); break;
+        case INY: set_nz( cpu, ++cpu->y ); break;
+
+        case JMP: cpu->pc = address; break;
+
+        case JSR:
+            --cpu->pc;
+            push( cpu, cpu->pc >> 8 );
+            push( cpu, cpu->pc & 0xFF );
+            cpu->pc = address;
+            break;
+
+        case RTS:
+            cpu->pc = pull( cpu );
+            cpu->pc |= pull( cpu ) << 8;
+            ++cpu->pc;
+            break;
+
+        case RTI:
+            cpu->p = ( pull( cpu ) & ~FLAG_B ) | FLAG_U;
+            cpu->pc = pull( cpu );
+            cpu->pc |= pull( cpu ) << 8;
+            break;
+
+        case LDA: cpu->a = read8( cpu, address ); set_nz( cpu, cpu->a ); break;
+        case LDX: cpu->x = read8( cpu, address ); set_nz( cpu, cpu->x ); break;
+        case LDY: cpu->y = read8( cpu, address ); set_nz( cpu, cpu->y ); break;
+
+        case STA: write8( cpu, address, cpu->a ); break;
+        case STX: write8( cpu, address, cpu->x ); break;
+        case STY: write8( cpu, address, cpu->y ); break;
+
+        case PHA: push( cpu, cpu->a ); break;
+        case PHP: push( cpu, cpu->p | FLAG_B | FLAG_U ); break;
+        case PLA: cpu->a = pull( cpu ); set_nz( cpu, cpu->a ); break;
+        case PLP: cpu->p = ( pull( cpu ) & ~FLAG_B ) | FLAG_U; break;
+
+        case TAX: cpu->x = cpu->a; set_nz( cpu, cpu->x ); break;
+        case TAY: cpu->y = cpu->a; set_nz( cpu, cpu->y ); break;
+        case TSX: cpu->x = cpu->s; set_nz( cpu, cpu->x ); break;
+        case TXA: cpu->a = cpu->x; set_nz( cpu, cpu->a ); break;
+        case TXS: cpu->s = cpu->x; break;
+        case TYA: cpu->a = cpu->y; set_nz( cpu, cpu->a ); break;
+
+        case NOP:
+        default:
+            break;
+    }
+
+    if ( taken )
+    {
+        cycles += ( cpu->pc & 0xFF00 ) == ( address & 0xFF00 ) ? 1 : 2;
+        cpu->pc = address;
+    }
+
+    cpu->cycles += cycles;
+
+    return cycles;
+}
+
+// Calls the subroutine as if with a JSR, running it until it returns. The JSR
+// itself is not counted. Returns false on undocumented opcodes or if the cycle
+// limit is reached.
+bool m6502_call( m6502_t *cpu, uint16_t address, uint64_t max_cycles )
+{
+    uint8_t s = cpu->s;
+    uint64_t limit = cpu->cycles + max_cycles;
+
+    push( cpu, ( RETURN_ADDRESS - 1 ) >> 8 );
+    push( cpu, ( RETURN_ADDRESS - 1 ) & 0xFF );
+    cpu->pc = address;
+
+    while ( cpu->pc != RETURN_ADDRESS || cpu->s != s )
+    {
+        if ( cpu->cycles >= limit || ! m6502_step( cpu ) )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
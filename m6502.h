@@ -0,0 +1,34 @@
+// Cycle counting 6502 simulator.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+#ifndef M6502_H
+#define M6502_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define M6502_MEMORY_SIZE 65536
+
+typedef struct {
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t s;
+    uint8_t p;
+    uint16_t pc;
+    uint64_t cycles;
+    uint8_t *memory;
+} m6502_t;
+
+void m6502_reset( m6502_t *cpu, uint8_t *memory );
+int m6502_step( m6502_t *cpu );
+bool m6502_call( m6502_t *cpu, uint16_t address, uint64_t max_cycles );
+
+#endif
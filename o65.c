@@ -0,0 +1,131 @@
+// Binary to o65 relocatable object format conversion routines.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// See http://www.6502.org/users/andre/o65/fileformat.html for the format
+// specification. Only the 16-bit, 6502 object file flavour is generated, with
+// all the image data in the data segment and no relocation entries.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "o65.h"
+
+#define O65_MODE_OBJ    0x1000
+
+#define O65_OPT_FNAME   0
+#define O65_OPT_ASM     2
+
+static bool put_byte( FILE *output_file, uint8_t byte )
+{
+    if ( EOF == fputc( byte, output_file ) )
+    {
+        perror( "Error writing to file" );
+        return false;
+    }
+
+    return true;
+}
+
+static bool put_word( FILE *output_file, uint16_t word )
+{
+    return put_byte( output_file, word & 0xFF ) && put_byte( output_file, ( word >> 8 ) & 0xFF );
+}
+
+static bool put_string( FILE *output_file, const char *string )
+{
+    if ( EOF == fputs( string, output_file ) )
+    {
+        perror( "Error writing to file" );
+        return false;
+    }
+
+    return put_byte( output_file, '\0' );
+}
+
+static bool put_option( FILE *output_file, uint8_t type, const char *value )
+{
+    size_t len = strlen( value ) + 1;
+
+    // Option length includes the length and type bytes
+    if ( len > 253 )
+    {
+        len = 253;
+    }
+
+    return put_byte( output_file, len + 2 )
+        && put_byte( output_file, type )
+        && o65_write( output_file, (uint8_t *) value, len - 1 )
+        && put_byte( output_file, '\0' );
+}
+
+bool o65_header( FILE *output_file, const char *name, uint16_t data_size )
+{
+    static const uint8_t marker[] = { 0x01, 0x00, 'o', '6', '5', 0x00 };
+
+    if ( ! o65_write( output_file, (uint8_t *) marker, sizeof( marker ) ) )
+    {
+        return false;
+    }
+
+    // Mode, tbase, tlen, dbase, dlen, bbase, blen, zbase, zlen, stack
+    uint16_t fields[] = { O65_MODE_OBJ, 0, 0, 0, data_size, 0, 0, 0, 0, 0 };
+
+    for ( size_t f = 0; f < sizeof( fields ) / sizeof( fields[0] ); ++f )
+    {
+        if ( ! put_word( output_file, fields[f] ) )
+        {
+            return false;
+        }
+    }
+
+    return put_option( output_file, O65_OPT_FNAME, name )
+        && put_option( output_file, O65_OPT_ASM, "kimg" )
+        && put_byte( output_file, 0 );
+}
+
+bool o65_write( FILE *output_file, uint8_t *data, size_t data_size )
+{
+    if ( data_size != fwrite( data, 1, data_size, output_file ) )
+    {
+        perror( "Error writing to file" );
+        return false;
+    }
+
+    return true;
+}
+
+bool o65_terminate( FILE *output_file, const o65_export_t *exports, uint16_t nexports )
+{
+    // No undefined references, empty text and data relocation tables
+    if ( ! put_word( output_file, 0 ) || ! put_byte( output_file, 0 ) || ! put_byte( output_file, 0 ) )
+    {
+        return false;
+    }
+
+    if ( ! put_word( output_file, nexports ) )
+    {
+        return false;
+    }
+
+    for ( uint16_t e = 0; e < nexports; ++e )
+    {
+        if (    ! put_string( output_file, exports[e].name )
+            ||  ! put_byte( output_file, exports[e].segment )
+            ||  ! put_word( output_file, exports[e].value ) )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
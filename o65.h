@@ -0,0 +1,33 @@
+// Binary to o65 relocatable object format conversion routines.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+#ifndef O65_H
+#define O65_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Segment ids for exported symbols
+#define O65_SEG_ABS     1
+#define O65_SEG_TEXT    2
+#define O65_SEG_DATA    3
+
+typedef struct {
+    const char *name;
+    uint8_t segment;
+    uint16_t value;
+} o65_export_t;
+
+bool o65_header( FILE *output_file, const char *name, uint16_t data_size );
+bool o65_write( FILE *output_file, uint8_t *data, size_t data_size );
+bool o65_terminate( FILE *output_file, const o65_export_t *exports, uint16_t nexports );
+
+#endif
@@ -0,0 +1,164 @@
+// Payload packer for free card memory.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// Payloads are binary files (sprites, fonts, code) that are loaded with the
+// image into card memory the image does not use. Each one must be contiguous,
+// so they are placed largest first, each into the smallest free region that
+// can hold it (best fit decreasing).
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <libgen.h>
+
+#include "pack.h"
+
+#define MAX_PAYLOAD_SIZE 8192
+
+// Reads a payload file. Its symbol is the file name without directory or
+// extension, upper case and with anything but letters and digits as '_'.
+bool pack_read_payload( pack_payload_t *payload, char *file_name )
+{
+    FILE *file = fopen( file_name, "rb" );
+    char *name_copy, *name;
+    uint8_t *data;
+    size_t nbytes;
+
+    if ( NULL == file )
+    {
+        perror( "Error opening payload file" );
+        return false;
+    }
+
+    payload->file_name = file_name;
+    payload->address = 0;
+    data = malloc( MAX_PAYLOAD_SIZE + 1 );
+    name_copy = strdup( file_name );
+
+    if ( NULL == data || NULL == name_copy )
+    {
+        perror( "Error: Can't allocate payload" );
+        free( data );
+        free( name_copy );
+        fclose( file );
+        return false;
+    }
+
+    nbytes = fread( data, 1, MAX_PAYLOAD_SIZE + 1, file );
+
+    if ( ferror( file ) )
+    {
+        perror( "Error reading payload file" );
+        free( data );
+        free( name_copy );
+        fclose( file );
+        return false;
+    }
+    fclose( file );
+
+    if ( 0 == nbytes || nbytes > MAX_PAYLOAD_SIZE )
+    {
+        fprintf( stderr, "Error: Payload '%s' must be 1 to %d bytes\n", file_name, MAX_PAYLOAD_SIZE );
+        free( data );
+        free( name_copy );
+        return false;
+    }
+    payload->size = (uint16_t) nbytes;
+
+    name = basename( name_copy );
+    if ( NULL != strchr( name + 1, '.' ) )
+    {
+        *strrchr( name, '.' ) = '\0';
+    }
+
+    // One more for a leading '_' if it starts with a digit
+    if ( NULL == ( payload->symbol = malloc( strlen( name ) + 2 ) ) )
+    {
+        perror( "Error: Can't allocate payload" );
+        free( data );
+        free( name_copy );
+        return false;
+    }
+
+    char *symbol = payload->symbol;
+
+    if ( isdigit( (unsigned char) *name ) )
+    {
+        *symbol++ = '_';
+    }
+    for ( ; *name; ++name )
+    {
+        *symbol++ = isalnum( (unsigned char) *name ) ? toupper( (unsigned char) *name ) : '_';
+    }
+    *symbol = '\0';
+
+    free( name_copy );
+
+    payload->data = data;
+
+    return true;
+}
+
+static int by_size( const void *a, const void *b )
+{
+    const pack_payload_t *pa = *(const pack_payload_t **) a, *pb = *(const pack_payload_t **) b;
+
+    return (int) pb->size - (int) pa->size;
+}
+
+// Assigns an address to every payload. Regions shrink as they are used.
+bool pack_payloads( pack_region_t *regions, int nregions, pack_payload_t *payloads, int npayloads )
+{
+    pack_payload_t **sorted = malloc( npayloads * sizeof( pack_payload_t * ) );
+
+    if ( NULL == sorted )
+    {
+        perror( "Error: Can't allocate payloads" );
+        return false;
+    }
+
+    for ( int p = 0; p < npayloads; ++p )
+    {
+        sorted[p] = &payloads[p];
+    }
+    qsort( sorted, npayloads, sizeof( pack_payload_t * ), by_size );
+
+    for ( int p = 0; p < npayloads; ++p )
+    {
+        pack_payload_t *payload = sorted[p];
+        pack_region_t *best = NULL;
+
+        for ( int r = 0; r < nregions; ++r )
+        {
+            if ( regions[r].size >= payload->size && ( NULL == best || regions[r].size < best->size ) )
+            {
+                best = &regions[r];
+            }
+        }
+
+        if ( NULL == best )
+        {
+            fprintf( stderr, "Error: No free card memory for payload '%s' (%u bytes)\n", payload->file_name, payload->size );
+            free( sorted );
+            return false;
+        }
+
+        payload->address = best->address;
+        best->address += payload->size;
+        best->size -= payload->size;
+    }
+
+    free( sorted );
+
+    return true;
+}
@@ -0,0 +1,33 @@
+// Payload packer for free card memory.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    uint16_t address;
+    uint16_t size;
+} pack_region_t;
+
+typedef struct {
+    char *file_name;
+    char *symbol;
+    uint8_t *data;
+    uint16_t size;
+    uint16_t address;           // Set by pack_payloads()
+} pack_payload_t;
+
+bool pack_read_payload( pack_payload_t *payload, char *file_name );
+bool pack_payloads( pack_region_t *regions, int nregions, pack_payload_t *payloads, int npayloads );
+
+#endif
@@ -13,6 +13,8 @@
 #include <stdbool.h>
 #include <errno.h>
 
+#include "hex.h"
+
 #define BYTES_PER_LINE 24
 
 bool pap_terminate( FILE *output_file, uint16_t lines )
@@ -28,7 +30,7 @@ bool pap_terminate( FILE *output_file, uint16_t lines )
 
 uint16_t pap_write( FILE *output_file, uint16_t address, uint8_t *data, size_t data_size )
 {
-    int byte_num = 0;
+    size_t byte_num = 0;
     uint16_t checksum = 0;
     uint16_t lines = 0;
 
@@ -73,3 +75,47 @@ uint16_t pap_write( FILE *output_file, uint16_t address, uint8_t *data, size_t d
 
     return lines;
 }
+
+// Same output as pap_write(), but every record is formatted in a buffer with
+// a digit table and written at once
+uint16_t pap_write_table( FILE *output_file, uint16_t address, uint8_t *data, size_t data_size )
+{
+    char record[1 + 2 + 4 + 2 * BYTES_PER_LINE + 4 + 1];
+    size_t byte_num = 0;
+    uint16_t lines = 0;
+
+    while ( byte_num < data_size )
+    {
+        uint8_t bytes_in_line = data_size - byte_num > BYTES_PER_LINE ? BYTES_PER_LINE : data_size - byte_num;
+        uint16_t checksum = bytes_in_line + ( ( address >> 8 ) & 0xFF ) + ( address & 0xFF );
+        char *p = record;
+
+        *p++ = ';';
+        p = hex_put( p, bytes_in_line, 2 );
+        p = hex_put( p, address, 4 );
+
+        for ( int b = 0; b < bytes_in_line; ++b )
+        {
+            uint8_t databyte = data[byte_num++];
+
+            p = hex_put( p, databyte, 2 );
+            checksum += databyte;
+        }
+
+        p = hex_put( p, checksum, 4 );
+        *p++ = '\n';
+
+        size_t length = p - record;
+
+        if ( length != fwrite( record, 1, length, output_file ) )
+        {
+            perror( "Error writing to file" );
+            return 0;
+        }
+
+        address += bytes_in_line;
+        ++lines;
+    }
+
+    return lines;
+}
@@ -16,6 +16,7 @@
 #include <stdbool.h>
 
 uint16_t pap_write( FILE *output_file, uint16_t address, uint8_t *data, size_t data_size );
+uint16_t pap_write_table( FILE *output_file, uint16_t address, uint8_t *data, size_t data_size );
 bool pap_terminate( FILE *output_file, uint16_t lines );
 
 #endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+// Simple parallel job runner.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// Jobs are numbered from 0 to njobs - 1 and handed out to one worker thread per
+// online CPU through a shared counter. The caller's thread is one of the
+// workers, so no thread is created for a single job.
+//
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+typedef struct {
+    parallel_job_fn job_fn;
+    void *arg;
+    int njobs;
+    atomic_int next_job;
+} parallel_t;
+
+int parallel_threads( void )
+{
+    long nprocs = sysconf( _SC_NPROCESSORS_ONLN );
+
+    return nprocs > 0 ? (int) nprocs : 1;
+}
+
+static void *worker( void *arg )
+{
+    parallel_t *parallel = arg;
+    int job;
+
+    while ( ( job = atomic_fetch_add( &parallel->next_job, 1 ) ) < parallel->njobs )
+    {
+        parallel->job_fn( parallel->arg, job );
+    }
+
+    return NULL;
+}
+
+void parallel_run( int njobs, parallel_job_fn job_fn, void *arg )
+{
+    parallel_t parallel = { job_fn, arg, njobs, 0 };
+    int nthreads = parallel_threads();
+    pthread_t threads[nthreads];
+    int started = 0;
+
+    if ( nthreads > njobs )
+    {
+        nthreads = njobs;
+    }
+
+    for ( int t = 1; t < nthreads; ++t )
+    {
+        // If a thread can't be created, the remaining workers take its jobs
+        if ( pthread_create( &threads[started], NULL, worker, &parallel ) )
+        {
+            break;
+        }
+        ++started;
+    }
+
+    worker( &parallel );
+
+    for ( int t = 0; t < started; ++t )
+    {
+        pthread_join( threads[t], NULL );
+    }
+}
@@ -0,0 +1,558 @@
+// Serial port record sender.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// The same PAP or IHEX records are sent to several serial ports at once from a
+// single epoll loop. Every port has its own pacing and, as the KIM-1 TTY
+// interface echoes what it receives, each record is checked against its echo.
+// Records with a bad or missing echo are resent on that port only, after the
+// rest of the data and before the final record. Any tty works, so ptys can
+// stand in for the boards.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/epoll.h>
+
+#include "send.h"
+
+#define MAX_RETRIES 3
+#define ECHO_TIMEOUT 1000       // Milliseconds, on top of the record transmission time
+
+static const char line_end[] = "\r\n";
+
+typedef struct {
+    const char *text;
+    size_t length;
+} record_t;
+
+typedef enum { PORT_SENDING, PORT_ECHO, PORT_DONE, PORT_ERROR } port_state_t;
+
+typedef struct {
+    const char *name;
+    int fd;
+    port_state_t state;
+    int *queue;
+    int nqueued;
+    int current;
+    int *failed;
+    int nfailed;
+    int retries;
+    int nretried;
+    bool final_queued;
+    bool record_failed;
+    bool settling;
+    bool out_armed;
+    size_t offset;
+    size_t echoed;
+    uint64_t next_write;
+    uint64_t deadline;
+} port_t;
+
+static uint64_t now_ms( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool get_speed( unsigned baud_rate, speed_t *speed )
+{
+    static const struct { unsigned baud_rate; speed_t speed; } speeds[] = {
+        { 110, B110 }, { 300, B300 }, { 600, B600 }, { 1200, B1200 }, { 2400, B2400 },
+        { 4800, B4800 }, { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+        { 57600, B57600 }, { 115200, B115200 }
+    };
+
+    for ( size_t s = 0; s < sizeof( speeds ) / sizeof( speeds[0] ); ++s )
+    {
+        if ( speeds[s].baud_rate == baud_rate )
+        {
+            *speed = speeds[s].speed;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int open_port( const char *name, speed_t speed )
+{
+    struct termios tio;
+    int fd = open( name, O_RDWR | O_NOCTTY | O_NONBLOCK );
+
+    if ( fd < 0 )
+    {
+        fprintf( stderr, "Error opening serial port %s: %s\n", name, strerror( errno ) );
+        return -1;
+    }
+
+    if ( tcgetattr( fd, &tio ) )
+    {
+        fprintf( stderr, "Error configuring serial port %s: %s\n", name, strerror( errno ) );
+        close( fd );
+        return -1;
+    }
+
+    cfmakeraw( &tio );
+    tio.c_cflag |= CLOCAL | CREAD;
+    cfsetispeed( &tio, speed );
+    cfsetospeed( &tio, speed );
+
+    if ( tcsetattr( fd, TCSANOW, &tio ) )
+    {
+        fprintf( stderr, "Error configuring serial port %s: %s\n", name, strerror( errno ) );
+        close( fd );
+        return -1;
+    }
+
+    tcflush( fd, TCIOFLUSH );
+
+    return fd;
+}
+
+static int split_records( const char *data, size_t data_size, record_t **records )
+{
+    int nrecords = 0;
+    const char *end = data + data_size;
+
+    *records = NULL;
+
+    while ( data < end )
+    {
+        const char *eol = memchr( data, '\n', end - data );
+        size_t length = ( eol ? eol : end ) - data;
+        record_t *new_records;
+
+        if ( length && data[length - 1] == '\r' )
+        {
+            --length;
+        }
+
+        if ( length )
+        {
+            if ( NULL == ( new_records = realloc( *records, ( nrecords + 1 ) * sizeof( record_t ) ) ) )
+            {
+                perror( "Error: Can't allocate records" );
+                free( *records );
+                return -1;
+            }
+            *records = new_records;
+            (*records)[nrecords].text = data;
+            (*records)[nrecords].length = length;
+            ++nrecords;
+        }
+
+        data = eol ? eol + 1 : end;
+    }
+
+    return nrecords;
+}
+
+static void start_record( port_t *port )
+{
+    port->state = PORT_SENDING;
+    port->offset = 0;
+    port->echoed = 0;
+    port->record_failed = false;
+}
+
+// Moves to the next queued record. When the queue is exhausted, failed
+// records are queued again and, once all succeed, the final record is sent.
+static void next_record( port_t *port, int nrecords )
+{
+    if ( ++port->current < port->nqueued )
+    {
+        start_record( port );
+        return;
+    }
+
+    if ( port->nfailed )
+    {
+        if ( port->retries++ == MAX_RETRIES )
+        {
+            fprintf( stderr, "Error: %s: %d records failed after %d retries\n", port->name, port->nfailed, MAX_RETRIES );
+            port->state = PORT_ERROR;
+            return;
+        }
+
+        int *queue = port->queue;
+
+        port->nretried += port->nfailed;
+        port->queue = port->failed;
+        port->nqueued = port->nfailed;
+        port->failed = queue;
+        port->nfailed = 0;
+        port->current = 0;
+        start_record( port );
+        return;
+    }
+
+    if ( ! port->final_queued )
+    {
+        port->queue[0] = nrecords - 1;
+        port->nqueued = 1;
+        port->current = 0;
+        port->final_queued = true;
+        start_record( port );
+        return;
+    }
+
+    port->state = PORT_DONE;
+}
+
+static void end_record( port_t *port, int nrecords )
+{
+    if ( port->record_failed )
+    {
+        if ( port->queue[port->current] != nrecords - 1 )
+        {
+            port->failed[port->nfailed++] = port->queue[port->current];
+        }
+        else if ( port->retries++ < MAX_RETRIES )
+        {
+            // The final record goes on its own, so it is simply queued again
+            ++port->nretried;
+            port->final_queued = false;
+        }
+        else
+        {
+            fprintf( stderr, "Error: %s: final record failed after %d retries\n", port->name, MAX_RETRIES );
+            port->state = PORT_ERROR;
+            return;
+        }
+    }
+
+    next_record( port, nrecords );
+}
+
+static void handle_write( port_t *port, record_t *records, int nrecords, const send_options_t *options )
+{
+    record_t *record = &records[port->queue[port->current]];
+    size_t total = record->length + sizeof( line_end ) - 1;
+
+    if ( port->settling )
+    {
+        tcflush( port->fd, TCIFLUSH );
+        port->settling = false;
+    }
+
+    while ( port->offset < total )
+    {
+        const char *from;
+        size_t length;
+        ssize_t written;
+
+        if ( port->offset < record->length )
+        {
+            from = record->text + port->offset;
+            length = record->length - port->offset;
+        }
+        else
+        {
+            from = line_end + port->offset - record->length;
+            length = total - port->offset;
+        }
+
+        // With pacing, characters are written one at a time
+        if ( options->char_delay )
+        {
+            length = 1;
+        }
+
+        if ( 0 > ( written = write( port->fd, from, length ) ) )
+        {
+            if ( errno == EAGAIN || errno == EINTR )
+            {
+                return;
+            }
+            fprintf( stderr, "Error writing to %s: %s\n", port->name, strerror( errno ) );
+            port->state = PORT_ERROR;
+            return;
+        }
+
+        port->offset += written;
+
+        if ( options->char_delay )
+        {
+            port->next_write = now_ms() + options->char_delay;
+            break;
+        }
+    }
+
+    if ( port->offset == total )
+    {
+        // With pacing, the whole echo may be already here
+        if ( options->verify_echo && port->echoed < record->length )
+        {
+            port->state = PORT_ECHO;
+            port->deadline = now_ms() + ECHO_TIMEOUT + total * 10 * 1000 / options->baud_rate;
+        }
+        else
+        {
+            end_record( port, nrecords );
+        }
+    }
+}
+
+static void handle_read( port_t *port, record_t *records, int nrecords, bool verify_echo )
+{
+    char buffer[256];
+    ssize_t nbytes;
+
+    while ( 0 < ( nbytes = read( port->fd, buffer, sizeof( buffer ) ) ) )
+    {
+        for ( ssize_t b = 0; b < nbytes; ++b )
+        {
+            if (    ! verify_echo || port->settling || buffer[b] == '\r' || buffer[b] == '\n'
+                 || ( port->state != PORT_SENDING && port->state != PORT_ECHO ) )
+            {
+                continue;
+            }
+
+            record_t *record = &records[port->queue[port->current]];
+
+            if ( port->echoed >= record->length || buffer[b] != record->text[port->echoed] )
+            {
+                port->record_failed = true;
+            }
+            ++port->echoed;
+
+            if ( port->state == PORT_ECHO && port->echoed >= record->length )
+            {
+                end_record( port, nrecords );
+            }
+        }
+    }
+
+    if ( 0 == nbytes || ( errno != EAGAIN && errno != EINTR ) )
+    {
+        fprintf( stderr, "Error reading from %s: %s\n", port->name, nbytes ? strerror( errno ) : "Hang up" );
+        port->state = PORT_ERROR;
+    }
+}
+
+static bool set_events( int epoll_fd, port_t *port, bool out )
+{
+    struct epoll_event event = { .events = EPOLLIN | ( out ? EPOLLOUT : 0 ), .data.ptr = port };
+
+    if ( out == port->out_armed )
+    {
+        return true;
+    }
+
+    port->out_armed = out;
+
+    return 0 == epoll_ctl( epoll_fd, EPOLL_CTL_MOD, port->fd, &event );
+}
+
+bool send_records( char **port_names, int nports, const char *data, size_t data_size, const send_options_t *options )
+{
+    port_t *ports = calloc( nports, sizeof( port_t ) );
+    struct epoll_event *events = calloc( nports, sizeof( struct epoll_event ) );
+    record_t *records = NULL;
+    int nrecords, epoll_fd = -1, active = 0;
+    bool result = false;
+    speed_t speed;
+
+    if ( ! get_speed( options->baud_rate, &speed ) )
+    {
+        fprintf( stderr, "Error: Unsupported baud rate %u\n", options->baud_rate );
+        goto out;
+    }
+
+    if ( NULL == ports || NULL == events )
+    {
+        perror( "Error: Can't allocate serial ports" );
+        goto out;
+    }
+
+    for ( int p = 0; p < nports; ++p )
+    {
+        ports[p].fd = -1;
+    }
+
+    if ( 0 >= ( nrecords = split_records( data, data_size, &records ) ) )
+    {
+        goto out;
+    }
+
+    if ( 0 > ( epoll_fd = epoll_create1( 0 ) ) )
+    {
+        perror( "Error: Can't create epoll instance" );
+        goto out;
+    }
+
+    for ( int p = 0; p < nports; ++p )
+    {
+        port_t *port = &ports[p];
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = port };
+
+        port->name = port_names[p];
+
+        if ( 0 > ( port->fd = open_port( port->name, speed ) ) )
+        {
+            goto out;
+        }
+
+        port->queue = malloc( nrecords * sizeof( int ) );
+        port->failed = malloc( nrecords * sizeof( int ) );
+
+        if ( NULL == port->queue || NULL == port->failed )
+        {
+            perror( "Error: Can't allocate record queue" );
+            goto out;
+        }
+
+        // All but the final record
+        for ( int r = 0; r < nrecords - 1; ++r )
+        {
+            port->queue[r] = r;
+        }
+        port->nqueued = nrecords - 1;
+        port->current = -1;
+        next_record( port, nrecords );
+
+        if ( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, port->fd, &event ) )
+        {
+            perror( "Error: Can't add serial port to epoll" );
+            goto out;
+        }
+        ++active;
+    }
+
+    printf( "Sending %d records to %d serial ports\n", nrecords, nports );
+
+    while ( active )
+    {
+        uint64_t now = now_ms();
+        int timeout = -1;
+
+        active = 0;
+
+        for ( int p = 0; p < nports; ++p )
+        {
+            port_t *port = &ports[p];
+            uint64_t wake = 0;
+
+            // A late echo would be taken for the next record's, so the input
+            // is discarded for a while and flushed before sending goes on
+            if ( port->state == PORT_ECHO && now >= port->deadline )
+            {
+                tcflush( port->fd, TCIFLUSH );
+                port->record_failed = true;
+                port->settling = true;
+                port->next_write = now + ECHO_TIMEOUT;
+                end_record( port, nrecords );
+            }
+
+            if ( port->state == PORT_DONE || port->state == PORT_ERROR )
+            {
+                continue;
+            }
+            ++active;
+
+            if ( port->state == PORT_SENDING && now < port->next_write )
+            {
+                wake = port->next_write;
+            }
+            else if ( port->state == PORT_ECHO )
+            {
+                wake = port->deadline;
+            }
+
+            if ( wake && ( timeout < 0 || wake - now < (uint64_t) timeout ) )
+            {
+                timeout = wake - now;
+            }
+
+            if ( ! set_events( epoll_fd, port, port->state == PORT_SENDING && now >= port->next_write ) )
+            {
+                perror( "Error: Can't modify epoll events" );
+                goto out;
+            }
+        }
+
+        if ( ! active )
+        {
+            break;
+        }
+
+        int nevents = epoll_wait( epoll_fd, events, nports, timeout );
+
+        if ( nevents < 0 && errno != EINTR )
+        {
+            perror( "Error waiting for serial ports" );
+            goto out;
+        }
+
+        for ( int e = 0; e < nevents; ++e )
+        {
+            port_t *port = events[e].data.ptr;
+
+            if ( events[e].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) )
+            {
+                handle_read( port, records, nrecords, options->verify_echo );
+            }
+
+            if ( port->state == PORT_SENDING && events[e].events & EPOLLOUT )
+            {
+                handle_write( port, records, nrecords, options );
+            }
+        }
+    }
+
+    result = true;
+
+    for ( int p = 0; p < nports; ++p )
+    {
+        port_t *port = &ports[p];
+
+        if ( port->state == PORT_DONE )
+        {
+            tcdrain( port->fd );
+            printf( "%s: OK, %d records resent\n", port->name, port->nretried );
+        }
+        else
+        {
+            printf( "%s: FAILED\n", port->name );
+            result = false;
+        }
+    }
+
+out:
+    for ( int p = 0; ports && p < nports; ++p )
+    {
+        if ( ports[p].fd >= 0 )
+        {
+            close( ports[p].fd );
+        }
+        free( ports[p].queue );
+        free( ports[p].failed );
+    }
+    if ( epoll_fd >= 0 )
+    {
+        close( epoll_fd );
+    }
+    free( records );
+    free( events );
+    free( ports );
+
+    return result;
+}
@@ -0,0 +1,25 @@
+// Serial port record sender.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+#ifndef SEND_H
+#define SEND_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct {
+    unsigned baud_rate;
+    unsigned char_delay;        // Milliseconds after each character
+    bool verify_echo;
+} send_options_t;
+
+bool send_records( char **port_names, int nports, const char *data, size_t data_size, const send_options_t *options );
+
+#endif
@@ -0,0 +1,183 @@
+// Slideshow ordering.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// When a slideshow is played by delta updates, every transition sends the
+// bytes that differ between two images, so the playback order is a travelling
+// salesman problem over the pairwise differences. It is solved with a nearest
+// neighbour tour improved by 2-opt, which is close enough for a few hundred
+// images. The tour is closed, as the show loops back to the first image.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slideshow.h"
+#include "parallel.h"
+
+#define LOW_BITS 0x0101010101010101ULL
+
+// Number of different bytes. Eight bytes are compared at a time: the XOR is
+// folded so that the low bit of every byte is set if any of its bits is, and
+// the set bits are counted.
+size_t slideshow_distance( const uint8_t *a, const uint8_t *b, size_t size )
+{
+    size_t distance = 0, offset = 0;
+
+    for ( ; offset + sizeof( uint64_t ) <= size; offset += sizeof( uint64_t ) )
+    {
+        uint64_t wa, wb, x;
+
+        memcpy( &wa, a + offset, sizeof( wa ) );
+        memcpy( &wb, b + offset, sizeof( wb ) );
+
+        x = wa ^ wb;
+        x |= x >> 4;
+        x |= x >> 2;
+        x |= x >> 1;
+        distance += __builtin_popcountll( x & LOW_BITS );
+    }
+
+    for ( ; offset < size; ++offset )
+    {
+        distance += a[offset] != b[offset];
+    }
+
+    return distance;
+}
+
+typedef struct {
+    const slideshow_t *show;
+    uint32_t *costs;
+} costs_ctx_t;
+
+// Fills a row of the upper triangle of the cost matrix, and its mirror
+static void cost_row( void *arg, int i )
+{
+    costs_ctx_t *ctx = (costs_ctx_t *) arg;
+    const slideshow_t *show = ctx->show;
+    int n = show->nimages;
+
+    for ( int j = i + 1; j < n; ++j )
+    {
+        size_t cost = 0;
+
+        for ( int plane = 0; plane < show->nplanes; ++plane )
+        {
+            size_t offset = plane * show->plane_stride;
+
+            cost += slideshow_distance( show->images[i] + offset, show->images[j] + offset, show->plane_size );
+        }
+
+        ctx->costs[i * n + j] = ctx->costs[j * n + i] = (uint32_t) cost;
+    }
+}
+
+uint32_t *slideshow_costs( const slideshow_t *show )
+{
+    costs_ctx_t ctx = { show, calloc( (size_t) show->nimages * show->nimages, sizeof( uint32_t ) ) };
+
+    if ( NULL == ctx.costs )
+    {
+        perror( "Error: Can't allocate slideshow costs" );
+        return NULL;
+    }
+
+    parallel_run( show->nimages, cost_row, &ctx );
+
+    return ctx.costs;
+}
+
+uint64_t slideshow_tour_cost( const uint32_t *costs, int n, const int *tour )
+{
+    uint64_t cost = 0;
+
+    for ( int i = 0; i < n; ++i )
+    {
+        cost += costs[tour[i] * n + tour[( i + 1 ) % n]];
+    }
+
+    return cost;
+}
+
+// Builds a closed tour starting at image 0. Returns its cost.
+uint64_t slideshow_order( const uint32_t *costs, int n, int *tour )
+{
+    bool *visited = calloc( n, sizeof( bool ) );
+    bool improved = true;
+
+    if ( NULL == visited )
+    {
+        // Keep the input order
+        for ( int i = 0; i < n; ++i )
+        {
+            tour[i] = i;
+        }
+        return slideshow_tour_cost( costs, n, tour );
+    }
+
+    tour[0] = 0;
+    visited[0] = true;
+
+    for ( int i = 1; i < n; ++i )
+    {
+        int last = tour[i - 1], best = -1;
+
+        for ( int j = 0; j < n; ++j )
+        {
+            if ( !visited[j] && ( best < 0 || costs[last * n + j] < costs[last * n + best] ) )
+            {
+                best = j;
+            }
+        }
+
+        tour[i] = best;
+        visited[best] = true;
+    }
+
+    free( visited );
+
+    // 2-opt: reverse tour[i+1..j] while that shortens the tour. As the costs
+    // are symmetric, only the two replaced edges matter.
+    while ( improved )
+    {
+        improved = false;
+
+        for ( int i = 0; i < n - 2; ++i )
+        {
+            for ( int j = i + 2; j < n; ++j )
+            {
+                int a = tour[i], b = tour[i + 1], c = tour[j], d = tour[( j + 1 ) % n];
+
+                if ( a == d )
+                {
+                    continue;
+                }
+
+                int64_t delta = (int64_t) costs[a * n + c] + costs[b * n + d] - costs[a * n + b] - costs[c * n + d];
+
+                if ( delta < 0 )
+                {
+                    for ( int l = i + 1, r = j; l < r; ++l, --r )
+                    {
+                        int t = tour[l];
+
+                        tour[l] = tour[r];
+                        tour[r] = t;
+                    }
+                    improved = true;
+                }
+            }
+        }
+    }
+
+    return slideshow_tour_cost( costs, n, tour );
+}
@@ -0,0 +1,30 @@
+// Slideshow ordering.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+#ifndef SLIDESHOW_H
+#define SLIDESHOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+    uint8_t **images;           // Converted images, all of the same size
+    int nimages;
+    int nplanes;
+    size_t plane_size;          // Bytes used in every plane
+    size_t plane_stride;        // Distance between planes
+} slideshow_t;
+
+size_t slideshow_distance( const uint8_t *a, const uint8_t *b, size_t size );
+uint32_t *slideshow_costs( const slideshow_t *show );
+uint64_t slideshow_tour_cost( const uint32_t *costs, int n, const int *tour );
+uint64_t slideshow_order( const uint32_t *costs, int n, int *tour );
+
+#endif
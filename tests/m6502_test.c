@@ -0,0 +1,92 @@
+// 6502 simulator cycle count test.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// Runs the plane copy routine used by "kimg -s" and checks the planes it copies
+// and the cycle counts against the ones worked out from the 6502 data sheet.
+// For R rows of B bytes with no page crossings it is R * ( 16 * B + 32 ) + 7: 2
+// for LDX, 16 per byte plus 32 per row, less 1 for the last byte and row, and 6
+// for RTS.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "../m6502.h"
+#include "../copy.h"
+
+static uint8_t memory[M6502_MEMORY_SIZE];
+
+// A source of 0 is chosen like kimg does
+static bool test_copy( const char *name, uint32_t source, uint32_t card, int rows, int row_bytes, uint64_t expected )
+{
+    uint8_t plane[COPY_CARD_SIZE];
+    m6502_t cpu;
+
+    for ( int b = 0; b < rows * row_bytes; ++b )
+    {
+        plane[b] = b * 7 + 1;
+    }
+
+    if ( 0 == source )
+    {
+        source = copy_source( card, rows * row_bytes );
+    }
+
+    if ( ! copy_plane( &cpu, memory, plane, source, card, row_bytes, rows ) )
+    {
+        printf( "FAIL: %s: routine did not return\n", name );
+        return false;
+    }
+
+    for ( int row = 0; row < rows; ++row )
+    {
+        if ( memcmp( memory + card + row * COPY_CARD_ROW_BYTES, plane + row * row_bytes, row_bytes ) )
+        {
+            printf( "FAIL: %s: row %d was not copied\n", name, row );
+            return false;
+        }
+    }
+
+    if ( cpu.cycles != expected )
+    {
+        printf( "FAIL: %s: %llu cycles, expected %llu\n", name, (unsigned long long) cpu.cycles, (unsigned long long) expected );
+        return false;
+    }
+
+    printf( "OK: %s: %llu cycles\n", name, (unsigned long long) cpu.cycles );
+
+    return true;
+}
+
+int main( void )
+{
+    bool result = true;
+
+    result = test_copy( "copy 4x8", 0x1000, 0x2000, 4, 8, 4 * ( 16 * 8 + 32 ) + 7 ) && result;
+
+    // LDA (SRC),Y crosses a page for Y = 4 to 7 in the first row, one cycle
+    // each, and the carry into SRC+1 costs BCC not taken plus INC, 4 more
+    result = test_copy( "copy 4x8 across a page", 0x10FC, 0x2000, 4, 8, 4 * ( 16 * 8 + 32 ) + 7 + 4 + 4 ) && result;
+
+    result = test_copy( "copy 6x40", 0x4000, 0x2000, 6, 40, 6 * ( 16 * 40 + 32 ) + 7 ) && result;
+
+    // Placed by kimg after the routine, below the card
+    result = test_copy( "copy 4x8 below the card", 0, 0x2000, 4, 8, 4 * ( 16 * 8 + 32 ) + 7 ) && result;
+
+    // A full plane does not fit below the first card, so kimg places it above,
+    // at $4000. LDA (SRC),Y crosses 504 pages and both SRC and DST carry into
+    // their high bytes 31 times.
+    result = test_copy( "copy 200x40 above the card", 0, 0x2000, 200, 40, 200 * ( 16 * 40 + 32 ) + 7 + 504 + 31 * 2 * 4 ) && result;
+
+    puts( result ? "PASS" : "FAIL" );
+
+    return result ? 0 : 1;
+}
@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+#
+# Serial sender test using pseudo terminals as stand-ins for the KIM-1 boards.
+#
+# Three boards are simulated: the first corrupts the echo of one record, the
+# second echoes one record too late and the third behaves. Every board must end
+# up with all the records and the final record last, and only the faulty
+# records must be resent.
+#
+# Usage: tests/send_pty.py [ <path to kimg> ]
+#
+# (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+#
+# https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+#
+
+import os
+import pty
+import random
+import select
+import subprocess
+import sys
+import tempfile
+import time
+import tty
+
+CORRUPT_RECORD = 3      # Echoed with a wrong character on the first board
+LATE_RECORD = 2         # Echoed after the echo timeout on the second board
+LATE_DELAY = 1.5        # Seconds, more than the echo timeout of the sender
+
+def write_image( path, width, height ):
+    random.seed( 1 )
+    with open( path, 'w' ) as f:
+        f.write( 'static unsigned int width = %d;\nstatic unsigned int height = %d;\n\n' % ( width, height ) )
+        f.write( '#define HEADER_PIXEL(data,pixel) {\\\n'
+                 'pixel[0] = header_data_cmap[(unsigned char)data[0]][0]; \\\n'
+                 'pixel[1] = header_data_cmap[(unsigned char)data[0]][1]; \\\n'
+                 'pixel[2] = header_data_cmap[(unsigned char)data[0]][2]; \\\n'
+                 'data ++; }\n\n' )
+        f.write( 'static unsigned char header_data_cmap[256][3] = {\n' )
+        f.write( '\t{  0,  0,  0},\n' + '\t{255,255,255},\n' * 255 + '\t};\n' )
+        f.write( 'static unsigned char header_data[] = {\n' )
+        pixels = [ str( random.randrange( 2 ) ) for _ in range( width * height ) ]
+        for p in range( 0, len( pixels ), 16 ):
+            f.write( '\t' + ','.join( pixels[p:p + 16] ) + ',\n' )
+        f.write( '\t};\n' )
+
+class Board:
+    def __init__( self, index ):
+        self.index = index
+        self.master, self.slave = pty.openpty()
+        tty.setraw( self.slave )
+        self.name = os.ttyname( self.slave )
+        self.received = b''
+        self.line = 0
+        self.pending = []       # ( time, bytes ) echoes not yet written
+
+    def feed( self, data ):
+        now = time.monotonic()
+        for c in data:
+            echo = bytes( [c] )
+            if self.index == 0 and self.line == CORRUPT_RECORD and c not in b'\r\n;:':
+                echo = bytes( [c ^ 1] )
+            if self.index == 1 and self.line == LATE_RECORD:
+                self.pending.append( ( now + LATE_DELAY, echo ) )
+            elif self.pending:
+                self.pending.append( ( self.pending[-1][0], echo ) )
+            else:
+                os.write( self.master, echo )
+            self.received += bytes( [c] )
+            if c == ord( '\n' ):
+                self.line += 1
+
+    def flush( self ):
+        now = time.monotonic()
+        while self.pending and self.pending[0][0] <= now:
+            os.write( self.master, self.pending.pop( 0 )[1] )
+
+def main():
+    kimg = os.path.abspath( sys.argv[1] if len( sys.argv ) > 1 else './kimg' )
+    boards = [ Board( b ) for b in range( 3 ) ]
+
+    with tempfile.TemporaryDirectory() as tmp:
+        image = os.path.join( tmp, 'image.h' )
+        output = os.path.join( tmp, 'image.pap' )
+        write_image( image, 64, 16 )
+
+        command = [ kimg, '-i', image, '-o', output, '-B', '115200' ]
+        for board in boards:
+            command += [ '-S', board.name ]
+        sender = subprocess.Popen( command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT )
+
+        masters = { board.master: board for board in boards }
+        while sender.poll() is None:
+            ready, _, _ = select.select( list( masters ), [], [], 0.05 )
+            for master in ready:
+                try:
+                    masters[master].feed( os.read( master, 1024 ) )
+                except OSError:
+                    pass
+            for board in boards:
+                board.flush()
+
+        log = sender.stdout.read().decode()
+        with open( output, 'rb' ) as f:
+            records = [ r.strip() for r in f.read().split( b'\n' ) if r.strip() ]
+
+    sys.stdout.write( log )
+    failures = []
+
+    if sender.returncode != 0:
+        failures.append( 'kimg exited with status %d' % sender.returncode )
+
+    for board, resent in zip( boards, ( 1, 1, 0 ) ):
+        got = [ r.strip() for r in board.received.split( b'\n' ) if r.strip() ]
+        if not got or got[-1] != records[-1]:
+            failures.append( '%s: final record missing or not last' % board.name )
+        if set( got ) != set( records ):
+            failures.append( '%s: received records differ from the output file' % board.name )
+        if '%s: OK, %d records resent' % ( board.name, resent ) not in log:
+            failures.append( '%s: expected %d records resent' % ( board.name, resent ) )
+
+    for failure in failures:
+        print( 'FAIL: ' + failure )
+    print( 'FAIL' if failures else 'PASS' )
+
+    return 1 if failures else 0
+
+if __name__ == '__main__':
+    sys.exit( main() )
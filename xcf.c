@@ -0,0 +1,665 @@
+// GIMP XCF indexed image reader.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// See https://gitlab.gnome.org/GNOME/gimp/-/blob/master/devel-docs/xcf.txt for
+// the format specification. Only indexed images are supported. The visible
+// layers are flattened bottom to top, with pixels whose alpha is below 50%
+// treated as transparent. Areas not covered by any layer get colormap index 0.
+// Layer opacity and modes are ignored.
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <zlib.h>
+
+#include "xcf.h"
+#include "zfile.h"
+#include "parallel.h"
+
+#define TILE_SIZE 64
+#define MAX_GROUP_DEPTH 32
+
+#define PROP_END            0
+#define PROP_COLORMAP       1
+#define PROP_VISIBLE        8
+#define PROP_OFFSETS        15
+#define PROP_COMPRESSION    17
+#define PROP_GROUP_ITEM     29
+#define PROP_ITEM_PATH      30
+
+#define COMPRESS_NONE       0
+#define COMPRESS_RLE        1
+#define COMPRESS_ZLIB       2
+
+#define INDEXED_GIMAGE      2
+#define INDEXED_IMAGE       4
+#define INDEXEDA_IMAGE      5
+
+static const char xcf_sig[] = "gimp xcf ";
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t pos;
+    int version;
+    int compression;
+    bool error;
+} xcf_t;
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t bpp;
+    int32_t x_offset;
+    int32_t y_offset;
+    uint8_t *pixels;
+} layer_t;
+
+// Visibility of the last group seen at every depth of the layer tree, hidden
+// parents included, and the deepest level the next layer can be at
+typedef struct {
+    bool shown[MAX_GROUP_DEPTH];
+    uint32_t max_depth;
+} groups_t;
+
+typedef struct {
+    layer_t *layer;
+    size_t offset;
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+} tile_job_t;
+
+typedef struct {
+    xcf_t *xcf;
+    tile_job_t *jobs;
+    atomic_bool failed;
+} tile_ctx_t;
+
+static uint32_t get_u32( xcf_t *xcf )
+{
+    if ( xcf->pos + 4 > xcf->size )
+    {
+        xcf->error = true;
+        return 0;
+    }
+
+    uint8_t *p = xcf->data + xcf->pos;
+    xcf->pos += 4;
+
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+// Pointers are 64-bit since XCF version 11
+static size_t get_pointer( xcf_t *xcf )
+{
+    uint64_t pointer = get_u32( xcf );
+
+    if ( xcf->version >= 11 )
+    {
+        pointer = pointer << 32 | get_u32( xcf );
+    }
+
+    if ( pointer > xcf->size )
+    {
+        xcf->error = true;
+        return 0;
+    }
+
+    return (size_t) pointer;
+}
+
+static void skip( xcf_t *xcf, size_t nbytes )
+{
+    if ( nbytes > xcf->size - xcf->pos )
+    {
+        xcf->error = true;
+        return;
+    }
+
+    xcf->pos += nbytes;
+}
+
+static bool read_all( FILE *image_file, xcf_t *xcf )
+{
+    size_t allocated = 0;
+    size_t nbytes;
+
+    xcf->data = NULL;
+    xcf->size = 0;
+
+    do
+    {
+        if ( xcf->size == allocated )
+        {
+            allocated = allocated ? allocated * 2 : BUFSIZ * 16;
+            uint8_t *data = realloc( xcf->data, allocated );
+
+            if ( NULL == data )
+            {
+                perror( "Error: Can't allocate XCF buffer" );
+                free( xcf->data );
+                return false;
+            }
+            xcf->data = data;
+        }
+
+        nbytes = fread( xcf->data + xcf->size, 1, allocated - xcf->size, image_file );
+        xcf->size += nbytes;
+
+    } while ( nbytes );
+
+    if ( ferror( image_file ) )
+    {
+        perror( "Error reading image file" );
+        free( xcf->data );
+        return false;
+    }
+
+    return true;
+}
+
+static bool decode_rle( xcf_t *xcf, size_t offset, uint8_t *tile, uint32_t npixels, uint32_t bpp )
+{
+    const uint8_t *p = xcf->data + offset;
+    const uint8_t *end = xcf->data + xcf->size;
+
+    // Each channel is encoded separately
+    for ( uint32_t channel = 0; channel < bpp; ++channel )
+    {
+        uint32_t count = 0;
+
+        while ( count < npixels )
+        {
+            uint32_t length;
+            bool run;
+
+            if ( p >= end )
+            {
+                return false;
+            }
+
+            uint8_t opcode = *p++;
+
+            if ( opcode <= 126 )
+            {
+                length = opcode + 1;
+                run = true;
+            }
+            else if ( opcode >= 129 )
+            {
+                length = 256 - opcode;
+                run = false;
+            }
+            else
+            {
+                if ( end - p < 2 )
+                {
+                    return false;
+                }
+                length = p[0] << 8 | p[1];
+                p += 2;
+                run = ( opcode == 127 );
+            }
+
+            if ( length > npixels - count || end - p < ( run ? 1 : length ) )
+            {
+                return false;
+            }
+
+            for ( uint32_t i = 0; i < length; ++i )
+            {
+                tile[( count + i ) * bpp + channel] = run ? *p : p[i];
+            }
+
+            p += run ? 1 : length;
+            count += length;
+        }
+    }
+
+    return true;
+}
+
+static bool decode_zlib( xcf_t *xcf, size_t offset, uint8_t *tile, uint32_t tile_size )
+{
+    z_stream strm = { 0 };
+
+    if ( Z_OK != inflateInit( &strm ) )
+    {
+        return false;
+    }
+
+    strm.next_in = xcf->data + offset;
+    strm.avail_in = xcf->size - offset;
+    strm.next_out = tile;
+    strm.avail_out = tile_size;
+
+    int ret = inflate( &strm, Z_FINISH );
+
+    inflateEnd( &strm );
+
+    return Z_STREAM_END == ret && strm.total_out == tile_size;
+}
+
+static void decode_tile( void *arg, int job )
+{
+    tile_ctx_t *ctx = arg;
+    tile_job_t *tile_job = &ctx->jobs[job];
+    layer_t *layer = tile_job->layer;
+    xcf_t *xcf = ctx->xcf;
+    uint8_t tile[TILE_SIZE * TILE_SIZE * 4];
+    uint32_t npixels = tile_job->w * tile_job->h;
+    uint32_t tile_size = npixels * layer->bpp;
+    bool ok;
+
+    if ( atomic_load( &ctx->failed ) )
+    {
+        return;
+    }
+
+    switch ( xcf->compression )
+    {
+        case COMPRESS_NONE:
+            ok = tile_size <= xcf->size - tile_job->offset;
+            if ( ok )
+            {
+                memcpy( tile, xcf->data + tile_job->offset, tile_size );
+            }
+            break;
+
+        case COMPRESS_RLE:
+            ok = decode_rle( xcf, tile_job->offset, tile, npixels, layer->bpp );
+            break;
+
+        case COMPRESS_ZLIB:
+            ok = decode_zlib( xcf, tile_job->offset, tile, tile_size );
+            break;
+
+        default:
+            ok = false;
+    }
+
+    if ( ! ok )
+    {
+        atomic_store( &ctx->failed, true );
+        return;
+    }
+
+    for ( uint32_t row = 0; row < tile_job->h; ++row )
+    {
+        memcpy( layer->pixels + ( ( tile_job->y + row ) * layer->width + tile_job->x ) * layer->bpp,
+                tile + row * tile_job->w * layer->bpp,
+                tile_job->w * layer->bpp );
+    }
+}
+
+static bool read_image_properties( xcf_t *xcf, xcf_image_t *image )
+{
+    uint32_t type, length;
+
+    xcf->compression = COMPRESS_NONE;
+    image->ncolors = 0;
+
+    while ( !xcf->error && PROP_END != ( type = get_u32( xcf ) ) )
+    {
+        length = get_u32( xcf );
+
+        switch ( type )
+        {
+            case PROP_COLORMAP:
+            {
+                size_t end = xcf->pos + length;
+
+                image->ncolors = get_u32( xcf );
+
+                if ( image->ncolors > XCF_MAX_COLORS || end > xcf->size || xcf->size - xcf->pos < (size_t) image->ncolors * 3 )
+                {
+                    xcf->error = true;
+                    break;
+                }
+
+                memcpy( image->cmap, xcf->data + xcf->pos, image->ncolors * 3 );
+                xcf->pos = end;
+                break;
+            }
+
+            case PROP_COMPRESSION:
+                xcf->compression = xcf->pos < xcf->size ? xcf->data[xcf->pos] : COMPRESS_NONE;
+                skip( xcf, length );
+                break;
+
+            default:
+                skip( xcf, length );
+        }
+    }
+
+    get_u32( xcf );                     // PROP_END length
+
+    return !xcf->error;
+}
+
+// Reads the layer header and the tile pointers of its first level. Returns the
+// number of tile jobs added, 0 for skipped layers and -1 on error. Layers come
+// top to bottom with groups before their children, so a layer can only be one
+// level below the previous one, and only if that one is a group.
+static int read_layer( xcf_t *xcf, layer_t *layer, tile_job_t *jobs, groups_t *groups )
+{
+    uint32_t type, prop_type, length, depth = 0;
+    bool visible = true, group = false;
+
+    layer->width = get_u32( xcf );
+    layer->height = get_u32( xcf );
+    type = get_u32( xcf );
+    skip( xcf, get_u32( xcf ) );        // Layer name
+
+    layer->x_offset = 0;
+    layer->y_offset = 0;
+    layer->pixels = NULL;
+
+    while ( !xcf->error && PROP_END != ( prop_type = get_u32( xcf ) ) )
+    {
+        length = get_u32( xcf );
+
+        switch ( prop_type )
+        {
+            case PROP_VISIBLE:
+                visible = get_u32( xcf );
+                skip( xcf, length - 4 );
+                break;
+
+            case PROP_OFFSETS:
+                layer->x_offset = (int32_t) get_u32( xcf );
+                layer->y_offset = (int32_t) get_u32( xcf );
+                skip( xcf, length - 8 );
+                break;
+
+            case PROP_GROUP_ITEM:
+                group = true;
+                skip( xcf, length );
+                break;
+
+            // One index per level of the group tree
+            case PROP_ITEM_PATH:
+                depth = length / 4 ? length / 4 - 1 : 0;
+                skip( xcf, length );
+                break;
+
+            default:
+                skip( xcf, length );
+        }
+    }
+
+    get_u32( xcf );                     // PROP_END length
+
+    if ( type != INDEXED_IMAGE && type != INDEXEDA_IMAGE )
+    {
+        fputs( "Error: Only indexed XCF images are supported\n", stderr );
+        return -1;
+    }
+
+    size_t hierarchy = get_pointer( xcf );
+
+    if ( xcf->error || depth > groups->max_depth || depth >= MAX_GROUP_DEPTH )
+    {
+        return -1;
+    }
+
+    visible = groups->shown[depth] = visible && ( depth == 0 || groups->shown[depth - 1] );
+    groups->max_depth = group ? depth + 1 : depth;
+
+    // Layer groups are composed from their children, which are stored as
+    // regular layers
+    if ( !visible || group || !layer->width || !layer->height )
+    {
+        return 0;
+    }
+
+    xcf->pos = hierarchy;
+    skip( xcf, 8 );                     // Hierarchy width and height, same as layer's
+    layer->bpp = get_u32( xcf );
+    xcf->pos = get_pointer( xcf );
+    skip( xcf, 8 );                     // Level width and height, same as layer's
+
+    if ( xcf->error || layer->bpp != ( type == INDEXED_IMAGE ? 1 : 2 ) )
+    {
+        return -1;
+    }
+
+    if ( NULL == ( layer->pixels = calloc( (size_t) layer->width * layer->height, layer->bpp ) ) )
+    {
+        perror( "Error: Can't allocate XCF layer" );
+        return -1;
+    }
+
+    int njobs = 0;
+
+    for ( uint32_t y = 0; y < layer->height; y += TILE_SIZE )
+    {
+        for ( uint32_t x = 0; x < layer->width; x += TILE_SIZE )
+        {
+            tile_job_t *job = &jobs[njobs++];
+
+            job->layer = layer;
+            job->offset = get_pointer( xcf );
+            job->x = x;
+            job->y = y;
+            job->w = layer->width - x < TILE_SIZE ? layer->width - x : TILE_SIZE;
+            job->h = layer->height - y < TILE_SIZE ? layer->height - y : TILE_SIZE;
+
+            if ( xcf->error || !job->offset )
+            {
+                return -1;
+            }
+        }
+    }
+
+    return njobs;
+}
+
+bool xcf_probe( const char *file_name )
+{
+    char buffer[sizeof( xcf_sig ) - 1];
+    FILE *image_file = zfopen( file_name );
+    bool is_xcf = false;
+
+    if ( NULL != image_file )
+    {
+        is_xcf = sizeof( buffer ) == fread( buffer, 1, sizeof( buffer ), image_file )
+                && !memcmp( buffer, xcf_sig, sizeof( buffer ) );
+
+        fclose( image_file );
+    }
+
+    return is_xcf;
+}
+
+bool xcf_read( FILE *image_file, xcf_image_t *image )
+{
+    xcf_t xcf = { 0 };
+    size_t *layer_pointers = NULL;
+    layer_t *layers = NULL;
+    tile_job_t *jobs = NULL;
+    int nlayers = 0, njobs = 0, maxjobs = 0;
+    groups_t groups = { { false }, 0 };
+    bool result = false;
+
+    image->pixels = NULL;
+
+    if ( ! read_all( image_file, &xcf ) )
+    {
+        return false;
+    }
+
+    // Signature is followed by "file" (version 0) or "vNNN" and a NUL
+    if ( xcf.size < 14 || memcmp( xcf.data, xcf_sig, sizeof( xcf_sig ) - 1 ) )
+    {
+        fputs( "Error: Not an XCF file\n", stderr );
+        goto out;
+    }
+
+    xcf.version = xcf.data[9] == 'v' ? atoi( (char *) xcf.data + 10 ) : 0;
+    xcf.pos = 14;
+
+    image->width = get_u32( &xcf );
+    image->height = get_u32( &xcf );
+
+    if ( INDEXED_GIMAGE != get_u32( &xcf ) )
+    {
+        fputs( "Error: Only indexed XCF images are supported\n", stderr );
+        goto out;
+    }
+
+    if ( xcf.version >= 4 )
+    {
+        skip( &xcf, 4 );                // Precision, always 8-bit for indexed images
+    }
+
+    if ( ! read_image_properties( &xcf, image ) )
+    {
+        goto bad_file;
+    }
+
+    // Layer pointers are stored top to bottom and terminated by a zero
+    size_t pointer;
+
+    while ( 0 != ( pointer = get_pointer( &xcf ) ) )
+    {
+        size_t *pointers = realloc( layer_pointers, ( nlayers + 1 ) * sizeof( size_t ) );
+
+        if ( NULL == pointers )
+        {
+            perror( "Error: Can't allocate XCF layers" );
+            goto out;
+        }
+        layer_pointers = pointers;
+        layer_pointers[nlayers++] = pointer;
+    }
+
+    if ( xcf.error )
+    {
+        goto bad_file;
+    }
+
+    if ( NULL == ( layers = calloc( nlayers ? nlayers : 1, sizeof( layer_t ) ) ) )
+    {
+        perror( "Error: Can't allocate XCF layers" );
+        goto out;
+    }
+
+    for ( int l = 0; l < nlayers; ++l )
+    {
+        xcf.pos = layer_pointers[l];
+
+        uint32_t width = get_u32( &xcf );
+        uint32_t height = get_u32( &xcf );
+        int ntiles = ( ( width + TILE_SIZE - 1 ) / TILE_SIZE ) * ( ( height + TILE_SIZE - 1 ) / TILE_SIZE );
+
+        if ( xcf.error || width > 0xFFFF || height > 0xFFFF )
+        {
+            goto bad_file;
+        }
+
+        tile_job_t *new_jobs = realloc( jobs, ( maxjobs + ntiles + 1 ) * sizeof( tile_job_t ) );
+
+        if ( NULL == new_jobs )
+        {
+            perror( "Error: Can't allocate XCF tiles" );
+            goto out;
+        }
+        jobs = new_jobs;
+        maxjobs += ntiles;
+
+        xcf.pos = layer_pointers[l];
+
+        int layer_jobs = read_layer( &xcf, &layers[l], jobs + njobs, &groups );
+
+        if ( layer_jobs < 0 )
+        {
+            goto bad_file;
+        }
+        njobs += layer_jobs;
+    }
+
+    tile_ctx_t ctx = { &xcf, jobs, false };
+
+    parallel_run( njobs, decode_tile, &ctx );
+
+    if ( atomic_load( &ctx.failed ) )
+    {
+        goto bad_file;
+    }
+
+    if ( NULL == ( image->pixels = calloc( image->width, image->height ) ) )
+    {
+        perror( "Error: Can't allocate image" );
+        goto out;
+    }
+
+    for ( int l = nlayers - 1; l >= 0; --l )
+    {
+        layer_t *layer = &layers[l];
+
+        if ( NULL == layer->pixels )
+        {
+            continue;
+        }
+
+        for ( uint32_t y = 0; y < layer->height; ++y )
+        {
+            int64_t image_y = (int64_t) y + layer->y_offset;
+
+            if ( image_y < 0 || image_y >= image->height )
+            {
+                continue;
+            }
+
+            for ( uint32_t x = 0; x < layer->width; ++x )
+            {
+                int64_t image_x = (int64_t) x + layer->x_offset;
+                uint8_t *pixel = layer->pixels + ( (size_t) y * layer->width + x ) * layer->bpp;
+
+                if ( image_x < 0 || image_x >= image->width || ( layer->bpp == 2 && pixel[1] < 128 ) )
+                {
+                    continue;
+                }
+
+                image->pixels[image_y * image->width + image_x] = pixel[0];
+            }
+        }
+    }
+
+    result = true;
+    goto out;
+
+bad_file:
+    fputs( "Error: Bad XCF file\n", stderr );
+
+out:
+    for ( int l = 0; layers && l < nlayers; ++l )
+    {
+        free( layers[l].pixels );
+    }
+    free( layers );
+    free( jobs );
+    free( layer_pointers );
+    free( xcf.data );
+
+    return result;
+}
+
+void xcf_free( xcf_image_t *image )
+{
+    free( image->pixels );
+    image->pixels = NULL;
+}
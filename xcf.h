@@ -0,0 +1,32 @@
+// GIMP XCF indexed image reader.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+#ifndef XCF_H
+#define XCF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define XCF_MAX_COLORS 256
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    int ncolors;
+    uint8_t cmap[XCF_MAX_COLORS][3];
+    uint8_t *pixels;
+} xcf_image_t;
+
+bool xcf_probe( const char *file_name );
+bool xcf_read( FILE *image_file, xcf_image_t *image );
+void xcf_free( xcf_image_t *image );
+
+#endif
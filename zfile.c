@@ -0,0 +1,300 @@
+// Transparent decompression of input files.
+//
+// This utility converts GIMP images in C source code header format to a format
+// suitable for display on a KIM-1 with one to four K-1008 cards as described in
+// the "Use of the K-1008 for grey scale display, app note #2" document.
+//
+// (C) 2024 Eduardo Casino under the terms of the General Public License, Version 2
+//
+// https://github.com/eduardocasino/k-1008-multiple-cards-image-util
+//
+// Input files are identified by their magic number. gzip and, if built with
+// HAVE_ZSTD, zstd compressed files are decompressed on the fly through a stdio
+// cookie stream, so callers just see the uncompressed text.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "zfile.h"
+
+#define ZBUFSIZ 65536
+
+static const uint8_t gzip_magic[] = { 0x1F, 0x8B };
+static const uint8_t zstd_magic[] = { 0x28, 0xB5, 0x2F, 0xFD };
+
+typedef struct {
+    FILE *file;
+    bool stream_end;
+    z_stream strm;
+    uint8_t in[ZBUFSIZ];
+} gz_cookie_t;
+
+static ssize_t gz_read( void *cookie, char *buf, size_t size )
+{
+    gz_cookie_t *gz = cookie;
+    bool eof = false;
+
+    gz->strm.next_out = (Bytef *) buf;
+    gz->strm.avail_out = size;
+
+    while ( gz->strm.avail_out )
+    {
+        if ( 0 == gz->strm.avail_in && ! eof )
+        {
+            gz->strm.next_in = gz->in;
+            gz->strm.avail_in = fread( gz->in, 1, sizeof( gz->in ), gz->file );
+            eof = ( 0 == gz->strm.avail_in );
+        }
+
+        if ( gz->stream_end )
+        {
+            // Zero padding after a member is ignored, as gzip -d does
+            for ( ; gz->strm.avail_in && 0 == *gz->strm.next_in; ++gz->strm.next_in, --gz->strm.avail_in );
+
+            if ( 0 == gz->strm.avail_in )
+            {
+                if ( eof )
+                {
+                    break;
+                }
+                continue;
+            }
+
+            // Concatenated gzip members
+            inflateReset( &gz->strm );
+            gz->stream_end = false;
+        }
+
+        // At the end of the input, inflate() may still have output pending
+        uInt avail_out = gz->strm.avail_out;
+        int ret = inflate( &gz->strm, Z_NO_FLUSH );
+
+        if ( Z_STREAM_END == ret )
+        {
+            gz->stream_end = true;
+        }
+        else if ( Z_BUF_ERROR == ret && eof )
+        {
+            break;
+        }
+        else if ( Z_OK != ret )
+        {
+            fprintf( stderr, "Error: Bad gzip data: %s\n", gz->strm.msg ? gz->strm.msg : zError( ret ) );
+            errno = EIO;
+            return -1;
+        }
+
+        if ( eof && avail_out == gz->strm.avail_out )
+        {
+            break;
+        }
+    }
+
+    size_t nbytes = size - gz->strm.avail_out;
+
+    if ( 0 == nbytes && ! gz->stream_end )
+    {
+        fputs( "Error: Truncated gzip data\n", stderr );
+        errno = EIO;
+        return -1;
+    }
+
+    return nbytes;
+}
+
+static int gz_close( void *cookie )
+{
+    gz_cookie_t *gz = cookie;
+
+    inflateEnd( &gz->strm );
+    fclose( gz->file );
+    free( gz );
+
+    return 0;
+}
+
+static FILE *gz_open( FILE *file )
+{
+    static const cookie_io_functions_t gz_functions = { .read = gz_read, .close = gz_close };
+    gz_cookie_t *gz = calloc( 1, sizeof( gz_cookie_t ) );
+
+    if ( NULL == gz )
+    {
+        return NULL;
+    }
+
+    gz->file = file;
+
+    // Window size plus 16 selects gzip decoding
+    if ( Z_OK != inflateInit2( &gz->strm, MAX_WBITS + 16 ) )
+    {
+        free( gz );
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    FILE *stream = fopencookie( gz, "r", gz_functions );
+
+    if ( NULL == stream )
+    {
+        inflateEnd( &gz->strm );
+        free( gz );
+    }
+
+    return stream;
+}
+
+#ifdef HAVE_ZSTD
+typedef struct {
+    FILE *file;
+    bool frame_end;
+    ZSTD_DStream *dstream;
+    ZSTD_inBuffer input;
+    uint8_t in[ZBUFSIZ];
+} zstd_cookie_t;
+
+static ssize_t zstd_read( void *cookie, char *buf, size_t size )
+{
+    zstd_cookie_t *zs = cookie;
+    ZSTD_outBuffer output = { buf, size, 0 };
+    bool eof = false;
+
+    while ( output.pos < output.size )
+    {
+        if ( zs->input.pos == zs->input.size && ! eof )
+        {
+            zs->input.src = zs->in;
+            zs->input.pos = 0;
+            zs->input.size = fread( zs->in, 1, sizeof( zs->in ), zs->file );
+            eof = ( 0 == zs->input.size );
+        }
+
+        if ( eof && zs->frame_end )
+        {
+            break;
+        }
+
+        // At the end of the input, the decoder may still hold data for a
+        // previous call that filled its output, so it runs until it stalls
+        size_t pos = output.pos;
+        size_t ret = ZSTD_decompressStream( zs->dstream, &output, &zs->input );
+
+        if ( ZSTD_isError( ret ) )
+        {
+            fprintf( stderr, "Error: Bad zstd data: %s\n", ZSTD_getErrorName( ret ) );
+            errno = EIO;
+            return -1;
+        }
+
+        zs->frame_end = ( 0 == ret );
+
+        if ( eof && pos == output.pos )
+        {
+            break;
+        }
+    }
+
+    if ( 0 == output.pos && ! zs->frame_end )
+    {
+        fputs( "Error: Truncated zstd data\n", stderr );
+        errno = EIO;
+        return -1;
+    }
+
+    return output.pos;
+}
+
+static int zstd_close( void *cookie )
+{
+    zstd_cookie_t *zs = cookie;
+
+    ZSTD_freeDStream( zs->dstream );
+    fclose( zs->file );
+    free( zs );
+
+    return 0;
+}
+
+static FILE *zstd_open( FILE *file )
+{
+    static const cookie_io_functions_t zstd_functions = { .read = zstd_read, .close = zstd_close };
+    zstd_cookie_t *zs = calloc( 1, sizeof( zstd_cookie_t ) );
+
+    if ( NULL == zs )
+    {
+        return NULL;
+    }
+
+    zs->file = file;
+
+    if ( NULL == ( zs->dstream = ZSTD_createDStream() ) )
+    {
+        free( zs );
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ZSTD_initDStream( zs->dstream );
+
+    FILE *stream = fopencookie( zs, "r", zstd_functions );
+
+    if ( NULL == stream )
+    {
+        ZSTD_freeDStream( zs->dstream );
+        free( zs );
+    }
+
+    return stream;
+}
+#endif
+
+FILE *zfopen( const char *file_name )
+{
+    uint8_t magic[sizeof( zstd_magic )];
+    FILE *file = fopen( file_name, "rb" );
+    FILE *stream = NULL;
+
+    if ( NULL == file )
+    {
+        return NULL;
+    }
+
+    size_t nbytes = fread( magic, 1, sizeof( magic ), file );
+    rewind( file );
+
+    if ( nbytes >= sizeof( gzip_magic ) && !memcmp( magic, gzip_magic, sizeof( gzip_magic ) ) )
+    {
+        stream = gz_open( file );
+    }
+    else if ( nbytes >= sizeof( zstd_magic ) && !memcmp( magic, zstd_magic, sizeof( zstd_magic ) ) )
+    {
+#ifdef HAVE_ZSTD
+        stream = zstd_open( file );
+#else
+        fputs( "Error: zstd support not compiled in\n", stderr );
+        errno = ENOTSUP;
+#endif
+    }
+    else
+    {
+        return file;
+    }
+
+    if ( NULL == stream )
+    {
+        int saved_errno = errno;
+        fclose( file );
+        errno = saved_errno;
+    }
+
+    return stream;
+}